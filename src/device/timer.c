@@ -4,18 +4,62 @@
 #include "interrupt.h"
 #include "thread.h"
 #include "debug.h"
+#include "global.h"
 
 #define IRQ0_FREQUENCY	   100
 #define INPUT_FREQUENCY	   1193180
-#define COUNTER0_VALUE	   INPUT_FREQUENCY / IRQ0_FREQUENCY
+#define COUNTER0_VALUE	   (INPUT_FREQUENCY / IRQ0_FREQUENCY)
 #define CONTRER0_PORT	   0x40
 #define COUNTER0_NO	   0
 #define COUNTER_MODE	   2
+#define ONESHOT_MODE	   0	  // 计数到0时发一次中断,之后不再重装
 #define READ_WRITE_LATCH   3
+#define COUNTER_LATCH	   0	  // 锁存当前计数值,供读出
 #define PIT_CONTROL_PORT   0x43
+#define COUNTER2_PORT	   0x42
+#define COUNTER2_NO	   2
+#define PIT_GATE_PORT	   0x61	  // 位0是计数器2的门控,位1打开扬声器,位5是计数器2的输出
+#define CALIBRATE_MS	   50
+#define CALIBRATE_COUNT	   (INPUT_FREQUENCY / 1000 * CALIBRATE_MS)	// 校准用的计数值,不超过16位
+#define TSC_SHIFT_MAX	   24
+#define ONESHOT_MAX_TICKS  (0xffff / COUNTER0_VALUE)	// 16位计数器单次最多能定时的嘀嗒数
 
 uint32_t ticks;          // ticks是内核自中断开启以来总共的嘀嗒数
 
+/*
+   动态时钟:只有idle可运行,或者运行的线程是唯一就绪的线程时,不需要每个嘀嗒都中断,
+   把PIT改为单次模式,只在下一个需要处理的时刻中断一次。离开单次模式时把经过的嘀嗒补上
+*/
+static bool tick_stopped;        // PIT是否处于单次模式
+static uint32_t oneshot_ticks;   // 单次模式定时的嘀嗒数
+
+/*
+   分级时间轮:tv1的256个槽各对应接下来的一个嘀嗒,tv2~tv4每级64个槽,每个槽覆盖上一级一整圈。
+   加入和取消定时器都是O(1)的链表操作;tv1转完一圈时把tv2当前槽中的定时器按到期时间重新分到tv1,依此类推。
+   最远能定时2^26个嘀嗒,更远的按最远处理
+*/
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TV_LEVELS 3	  // tv1之上的级数
+#define TIMER_MAX_DELTA ((1U << (TVR_BITS + TV_LEVELS * TVN_BITS)) - 1)
+
+static struct list tv1[TVR_SIZE];
+static struct list tvn[TV_LEVELS][TVN_SIZE];
+static uint32_t timer_jiffies;	  // 下一个要处理的嘀嗒,比它早的槽都已处理过
+
+/*
+   高精度时钟:开机时用PIT校准TSC的频率,之后读TSC换算成纳秒,ns = (tsc - tsc_base) * tsc_mult >> tsc_shift。
+   换算只用乘法和移位,不做64位除法。TSC不可用时退回到按嘀嗒计时
+*/
+static uint64_t tsc_base;	  // 校准结束时的TSC,纳秒时钟从这里开始算
+static uint32_t tsc_khz;	  // TSC每毫秒走多少,为0表示没有TSC
+static uint32_t tsc_mult;
+static uint32_t tsc_shift;
+
 /* 把操作的计数器counter_no、读写锁属性rwl、计数器模式counter_mode写入模式控制寄存器并赋予初始值counter_value */
 static void frequency_set(uint8_t counter_port, \
 			  uint8_t counter_no, \
@@ -27,7 +71,257 @@ static void frequency_set(uint8_t counter_port, \
 /* 先写入counter_value的低8位 */
    outb(counter_port, (uint8_t)counter_value);
 /* 再写入counter_value的高8位 */
-   outb(counter_port, (uint8_t)counter_value >> 8);
+   outb(counter_port, (uint8_t)(counter_value >> 8));
+}
+
+/* 读出计数器0当前的计数值 */
+static uint16_t counter0_read(void) {
+   outb(PIT_CONTROL_PORT, (uint8_t)(COUNTER0_NO << 6 | COUNTER_LATCH << 4));
+   uint8_t low = inb(CONTRER0_PORT);
+   uint8_t high = inb(CONTRER0_PORT);
+   return (uint16_t)(high << 8 | low);
+}
+
+/* 读时间戳计数器 */
+static uint64_t rdtsc(void) {
+   uint32_t low, high;
+   asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+   return (uint64_t)high << 32 | low;
+}
+
+/* 64位数除以32位数,商是64位的,余数存入remainder(可以为NULL)。用两次divl,不依赖libgcc */
+uint64_t div_u64_rem(uint64_t dividend, uint32_t divisor, uint32_t* remainder) {
+   uint32_t high = (uint32_t)(dividend >> 32);
+   uint32_t q_high = high / divisor;
+   uint32_t q_low, rem;
+   asm ("divl %4" : "=a" (q_low), "=d" (rem) : "a" ((uint32_t)dividend), "d" (high % divisor), "rm" (divisor));
+   if (remainder != NULL) {
+      *remainder = rem;
+   }
+   return (uint64_t)q_high << 32 | q_low;
+}
+
+/*
+   Description:
+      用PIT的计数器2定时CALIBRATE_MS毫秒,数这段时间TSC走了多少,算出TSC的频率和换算纳秒的系数
+   Details:
+      - 计数器2的门控由0x61端口控制,不连扬声器,不影响计数器0的时钟中断
+      - tsc_shift取尽量大的值,使tsc_mult不超过32位,换算的精度最高
+*/
+static void tsc_calibrate(void) {
+   uint8_t gate = inb(PIT_GATE_PORT);
+   outb(PIT_GATE_PORT, (gate & ~0x02) | 0x01);
+   frequency_set(COUNTER2_PORT, COUNTER2_NO, READ_WRITE_LATCH, ONESHOT_MODE, CALIBRATE_COUNT);
+   uint64_t start = rdtsc();
+   while (!(inb(PIT_GATE_PORT) & 0x20)) {
+   }
+   uint64_t end = rdtsc();
+   outb(PIT_GATE_PORT, gate);
+
+   tsc_khz = (uint32_t)(end - start) / CALIBRATE_MS;
+   if (tsc_khz == 0) {
+      return;
+   }
+   tsc_shift = TSC_SHIFT_MAX;
+   while (tsc_shift > 0 && (uint32_t)((1000000ULL << tsc_shift) >> 32) >= tsc_khz) {
+      tsc_shift--;
+   }
+   tsc_mult = (uint32_t)div_u64_rem(1000000ULL << tsc_shift, tsc_khz, NULL);
+   tsc_base = end;
+}
+
+/* 开机以来的纳秒数,单调递增。64位的tsc差值乘32位的系数,拆成两个32x32的乘法,不会溢出 */
+uint64_t clock_ns(void) {
+   if (tsc_khz == 0) {
+      return (uint64_t)ticks * (1000000000 / IRQ0_FREQUENCY);
+   }
+   uint64_t delta = rdtsc() - tsc_base;
+   uint64_t prod_low = (uint64_t)(uint32_t)delta * tsc_mult;
+   uint64_t prod_high = (uint64_t)(uint32_t)(delta >> 32) * tsc_mult;
+   return (prod_low >> tsc_shift) + (prod_high << (32 - tsc_shift));
+}
+
+/*
+   Description:
+      把clock_id对应的时钟的当前值写入tp
+   Return:
+      成功返回0,不支持的时钟返回-1
+   Details:
+      CLOCK_MONOTONIC是开机以来的时间,CLOCK_THREAD_CPUTIME_ID是当前线程在cpu上运行的时间,
+      分辨率都是TSC的精度,用于测量延迟
+*/
+int32_t sys_clock_gettime(uint32_t clock_id, struct timespec* tp) {
+   uint64_t now = clock_ns();
+   uint64_t ns;
+   if (clock_id == CLOCK_MONOTONIC) {
+      ns = now;
+   } else if (clock_id == CLOCK_THREAD_CPUTIME_ID) {
+      struct task_struct* cur = running_thread();
+      ns = cur->runtime_ns + (now - cur->exec_start);
+   } else {
+      return -1;
+   }
+   uint32_t nsec;
+   tp->tv_sec = (uint32_t)div_u64_rem(ns, 1000000000, &nsec);
+   tp->tv_nsec = nsec;
+   return 0;
+}
+
+/* 初始化定时器t,到期时调用func(arg) */
+void timer_setup(struct timer* t, timer_func* func, void* arg) {
+   t->func = func;
+   t->arg = arg;
+   t->pending = false;
+}
+
+/* 按到期时间把t挂到时间轮对应的槽中,已经过期的挂到下一个要处理的槽 */
+static void timer_enqueue(struct timer* t) {
+   uint32_t delta = t->expires - timer_jiffies;
+   struct list* slot;
+   if ((int32_t)delta < 0) {
+      slot = &tv1[timer_jiffies & TVR_MASK];
+   } else if (delta < TVR_SIZE) {
+      slot = &tv1[t->expires & TVR_MASK];
+   } else {
+      if (delta > TIMER_MAX_DELTA) {
+	 t->expires = timer_jiffies + TIMER_MAX_DELTA;
+	 delta = TIMER_MAX_DELTA;
+      }
+      uint32_t level = 0;
+      while (delta >= 1U << (TVR_BITS + (level + 1) * TVN_BITS)) {
+	 level++;
+      }
+      slot = &tvn[level][(t->expires >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK];
+   }
+   list_append(slot, &t->elem);
+}
+
+/* 启动定时器t,在ticks到达expires时到期。t已在等待时改为新的到期时间 */
+void timer_add(struct timer* t, uint32_t expires) {
+   enum intr_status old_status = intr_disable();
+   if (t->pending) {
+      list_remove(&t->elem);
+   }
+   t->expires = expires;
+   t->pending = true;
+   timer_enqueue(t);
+   intr_set_status(old_status);
+}
+
+/* 取消定时器t,t还在等待时返回true,已经到期或没有启动返回false */
+bool timer_del(struct timer* t) {
+   enum intr_status old_status = intr_disable();
+   bool pending = t->pending;
+   if (pending) {
+      list_remove(&t->elem);
+      t->pending = false;
+   }
+   intr_set_status(old_status);
+   return pending;
+}
+
+/* 把第level级当前槽中的定时器重新按到期时间分到下面的级中,返回槽的下标 */
+static uint32_t timer_cascade(uint32_t level) {
+   uint32_t idx = (timer_jiffies >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK;
+   struct list* slot = &tvn[level][idx];
+   while (!list_empty(slot)) {
+      timer_enqueue(elem2entry(struct timer, elem, list_pop(slot)));
+   }
+   return idx;
+}
+
+/* 处理到ticks为止所有到期的定时器 */
+static void timers_run(void) {
+   while ((int32_t)(ticks - timer_jiffies) >= 0) {
+      uint32_t idx = timer_jiffies & TVR_MASK;
+      uint32_t level = 0;
+      if (idx == 0) {	  // tv1转完一圈,从上一级取下一圈的定时器
+	 while (level < TV_LEVELS && timer_cascade(level) == 0) {
+	    level++;
+	 }
+      }
+      struct list* slot = &tv1[idx];
+      while (!list_empty(slot)) {
+	 struct timer* t = elem2entry(struct timer, elem, list_pop(slot));
+	 t->pending = false;
+	 t->func(t->arg);
+      }
+      timer_jiffies++;
+   }
+}
+
+/* 从下一个嘀嗒起,最多看limit个嘀嗒,到第几个嘀嗒时有定时器要处理。tv1转完一圈时要从上一级取定时器,也算 */
+static uint32_t timer_next_event(uint32_t limit) {
+   uint32_t n = 0;
+   while (n + 1 < limit) {
+      uint32_t idx = (timer_jiffies + n) & TVR_MASK;
+      if (idx == 0 || !list_empty(&tv1[idx])) {
+	 break;
+      }
+      n++;
+   }
+   return n + 1;
+}
+
+/* 当前线程cur运行了n个嘀嗒,逐个嘀嗒记账,返回是否需要调度 */
+static bool ticks_account(struct task_struct* cur, uint32_t n) {
+   bool resched = false;
+   while (n-- > 0) {
+      cur->elapsed_ticks++;	  // 记录此线程占用的cpu时间嘀
+      ticks++;	  //从内核第一次处理时间中断后开始至今的滴哒数,内核态和用户态总共的嘀哒数
+      timers_run();	  // 到期的定时器可能唤醒线程,下面的抢占检查要能看到
+      if (thread_tick(cur)) {	  // 有更高优先级的线程就绪时抢占当前线程
+	 resched = true;
+      }
+      if (cur->ticks == 0) {	  // 若进程时间片用完就开始调度新的进程上cpu
+	 resched = true;
+      } else {			  // 将当前进程的时间片-1
+	 cur->ticks--;
+      }
+   }
+   return resched;
+}
+
+/*
+   Description:
+      在接下来的max_ticks个嘀嗒内没有要按嘀嗒处理的事时,停掉周期时钟,改为单次定时
+   Details:
+      - 须在关中断时调用
+      - 16位计数器最多定时ONESHOT_MAX_TICKS个嘀嗒,只省一两个嘀嗒时不值得改模式
+      - 不能越过下一个定时器到期的嘀嗒
+*/
+void timer_tick_stop(uint32_t max_ticks) {
+   ASSERT(intr_get_status() == INTR_OFF);
+   uint32_t n = max_ticks < ONESHOT_MAX_TICKS ? max_ticks : ONESHOT_MAX_TICKS;
+   n = timer_next_event(n);
+   if (tick_stopped || n < 2) {
+      return;
+   }
+   frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, ONESHOT_MODE, n * COUNTER0_VALUE);
+   oneshot_ticks = n;
+   tick_stopped = true;
+}
+
+/*
+   Description:
+      提前离开单次模式,恢复周期时钟,把已经过去的嘀嗒记到当前线程上
+   Details:
+      - 有线程就绪或者要调度时调用,须在关中断时调用
+      - 不足一个嘀嗒的部分舍去。单次定时已经到了的,中断还挂着,最后一个嘀嗒留给它记
+   Return:
+      记账时发现要调度(时间片用完或者有更该运行的线程)时返回true
+*/
+bool timer_tick_restart(void) {
+   ASSERT(intr_get_status() == INTR_OFF);
+   if (!tick_stopped) {
+      return false;
+   }
+   uint32_t total = oneshot_ticks * COUNTER0_VALUE;
+   uint32_t remain = counter0_read();
+   uint32_t n = (remain == 0 || remain > total) ? oneshot_ticks - 1 : (total - remain) / COUNTER0_VALUE;
+   frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
+   tick_stopped = false;
+   return ticks_account(running_thread(), n);
 }
 
 /* 时钟的中断处理函数 */
@@ -36,19 +330,62 @@ static void intr_timer_handler(void) {
 
    ASSERT(cur_thread->stack_magic == 0x19870916);         // 检查栈是否溢出
 
-   cur_thread->elapsed_ticks++;	  // 记录此线程占用的cpu时间嘀
-   ticks++;	  //从内核第一次处理时间中断后开始至今的滴哒数,内核态和用户态总共的嘀哒数
-
-   if (cur_thread->ticks == 0) {	  // 若进程时间片用完就开始调度新的进程上cpu
+   uint32_t n = 1;
+   if (tick_stopped) {	  // 单次定时到了,补上这段时间的嘀嗒,恢复周期时钟
+      n = oneshot_ticks;
+      frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
+      tick_stopped = false;
+   }
+   if (ticks_account(cur_thread, n)) {
       schedule(); 
-   } else {				  // 将当前进程的时间片-1
-      cur_thread->ticks--;
+   } else {	  // 没有别的线程要运行时,到时间片用完前都不需要时钟中断
+      timer_tick_stop(thread_nohz_ticks(cur_thread));
+   }
+}
+
+/* 毫秒数换算成嘀嗒数,不足一个嘀嗒的按一个算。不用DIV_ROUND_UP,ms接近0xffffffff时加上除数会回绕 */
+uint32_t ms_to_ticks(uint32_t ms) {
+   return ms / (1000 / IRQ0_FREQUENCY) + (ms % (1000 / IRQ0_FREQUENCY) != 0);
+}
+
+/* 当前线程睡眠n个嘀嗒,期间不占用cpu */
+static void ticks_sleep(uint32_t n) {
+   if (n == 0) {
+      return;
    }
+   enum intr_status old_status = intr_disable();
+   thread_block_timeout(TASK_BLOCKED, n, false);
+   intr_set_status(old_status);
+}
+
+/* 睡眠seconds秒,返回0 */
+uint32_t sys_sleep(uint32_t seconds) {
+   uint32_t n = seconds > TIMER_MAX_DELTA / IRQ0_FREQUENCY ? TIMER_MAX_DELTA : seconds * IRQ0_FREQUENCY;
+   ticks_sleep(n);
+   return 0;
+}
+
+/* 睡眠usec微秒,精度是一个嘀嗒,返回0 */
+int32_t sys_usleep(uint32_t usec) {
+   ticks_sleep(usec / (1000000 / IRQ0_FREQUENCY) + (usec % (1000000 / IRQ0_FREQUENCY) != 0));
+   return 0;
 }
 
 /* 初始化PIT8253 */
 void timer_init() {
    put_str("timer_init start\n");
+   uint32_t idx;
+   for (idx = 0; idx < TVR_SIZE; idx++) {
+      list_init(&tv1[idx]);
+   }
+   uint32_t level;
+   for (level = 0; level < TV_LEVELS; level++) {
+      for (idx = 0; idx < TVN_SIZE; idx++) {
+	 list_init(&tvn[level][idx]);
+      }
+   }
+   timer_jiffies = ticks + 1;
+   tsc_calibrate();
    /* 设置8253的定时周期,也就是发中断的周期 */
    frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
    register_handler(0x20, intr_timer_handler);
@@ -1,6 +1,41 @@
 #ifndef __DEVICE_TIME_H
 #define __DEVICE_TIME_H
 #include "stdint.h"
+#include "list.h"
+
+/* 定时器到期时在时钟中断中调用的函数,此时是关中断的 */
+typedef void timer_func(void* arg);
+
+/* 内核定时器,挂在时间轮的某个槽中 */
+struct timer {
+   struct list_elem elem;  // 时间轮槽中的结点
+   uint32_t expires;	   // 到期时的ticks
+   timer_func* func;
+   void* arg;
+   bool pending;	   // 是否在时间轮中等待到期
+};
+
+/* clock_gettime的时钟 */
+#define CLOCK_MONOTONIC 1	   // 开机以来单调递增的时间
+#define CLOCK_THREAD_CPUTIME_ID 3  // 当前线程占用cpu的时间
+
+struct timespec {
+   uint32_t tv_sec;
+   uint32_t tv_nsec;
+};
+
+extern uint32_t ticks;
 void timer_init(void);
+void timer_setup(struct timer* t, timer_func* func, void* arg);
+void timer_add(struct timer* t, uint32_t expires);
+bool timer_del(struct timer* t);
+uint32_t ms_to_ticks(uint32_t ms);
+uint32_t sys_sleep(uint32_t seconds);
+int32_t sys_usleep(uint32_t usec);
+uint64_t div_u64_rem(uint64_t dividend, uint32_t divisor, uint32_t* remainder);
+uint64_t clock_ns(void);
+int32_t sys_clock_gettime(uint32_t clock_id, struct timespec* tp);
+void timer_tick_stop(uint32_t max_ticks);
+bool timer_tick_restart(void);
 #endif
 
@@ -83,6 +83,7 @@ void sys_help(void)
     printk("buildin commands:\n");
     printk("    ps: process status\n");
     printk("    clear: clear screen\n");
+    printk("    meminfo: memory usage\n");
     printk("\n");
     printk("buildin processes:\n");
     printk("    hello: say \"Hello, World\"\n");
@@ -8,17 +8,21 @@
 #include "keyboard.h"
 #include "tss.h"
 #include "syscall-init.h"
+#include "shm.h"
+#include "process.h"
 
 /*负责初始化所有模块 */
 void init_all() {
    put_str("init_all\n");
    idt_init();	     // 初始化中断
    mem_init();	     // 初始化内存管理系统
+   process_init();   // 初始化进程用到的对象缓存
    thread_init();    // 初始化线程相关结构
    timer_init();     // 初始化PIT
    console_init();   // 控制台初始化最好放在开中断之前
    keyboard_init();  // 键盘初始化
    tss_init();       // tss初始化
    syscall_init();   // 初始化系统调用
+   shm_init();       // 初始化共享内存段表
    intr_enable();      // 后面的 ide_init 需要打开中断
 }
@@ -3,6 +3,7 @@
 #include "global.h"
 #include "io.h"
 #include "print.h"
+#include "memory.h"
 
 #define PIC_M_CTRL 0x20 // 这里用的可编程中断控制器是8259A,主片的控制端口是0x20
 #define PIC_M_DATA 0x21 // 主片的数据端口是0x21
@@ -125,6 +126,19 @@ static void general_intr_handler(uint8_t vec_nr)
         ;
 }
 
+/* 缺页异常的处理函数,能修复的缺页(如写时复制)修复后直接返回重新执行指令,否则按一般异常处理 */
+static void page_fault_handler(uint8_t vec_nr)
+{
+    uint32_t page_fault_vaddr = 0;
+    asm("movl %%cr2, %0"
+        : "=r"(page_fault_vaddr));
+    if (page_fault_fixup(page_fault_vaddr))
+    {
+        return;
+    }
+    general_intr_handler(vec_nr);
+}
+
 /* 完成一般中断处理函数注册及异常名称注册 */
 static void exception_init(void)
 { // 完成一般中断处理函数注册及异常名称注册
@@ -158,6 +172,8 @@ static void exception_init(void)
     intr_name[17] = "#AC Alignment Check Exception";
     intr_name[18] = "#MC Machine-Check Exception";
     intr_name[19] = "#XF SIMD Floating-Point Exception";
+
+    idt_table[14] = page_fault_handler;
 }
 
 /* 开中断并返回开中断前的状态*/
@@ -7,27 +7,116 @@
 #include "string.h"
 #include "sync.h"
 #include "interrupt.h"
-
-/***************  位图地址 ********************
- * 因为0xc009f000是内核主线程栈顶，0xc009e000是内核主线程的pcb.
- * 一个页框大小的位图可表示128M内存, 位图位置安排在地址0xc009a000,
- * 这样本系统最大支持4个页框的位图,即512M内存 */
-#define MEM_BITMAP_BASE 0xc009a000
+#include "process.h"
+#include "vma.h"
+
+/***************  loader留下的内存信息 ********************
+ * loader.bin加载到0x900, total_mem_bytes在0xb00,
+ * 紧接着是6字节的gdt_ptr, ards_buf在0xb0a, ards_nr在0xbfe */
+#define TOTAL_MEM_BYTES_ADDR 0xb00
+#define ARDS_BUF_ADDR 0xb0a
+#define ARDS_NR_ADDR 0xbfe
+#define ARDS_MAX 12        // ards_buf最多容纳的ARDS个数
+#define ARDS_TYPE_USABLE 1 // 操作系统可以使用的内存
 /*************************************/
 
+#define ARENA_MAX_PAGES 32     // 最大的arena占32页
+
+/* 每个zone最多预先清0的页框数 */
+#define PREZERO_PAGES_MAX 64
+
+/* 低端内存中留给内核的页框比例的倒数,用户进程不能把低端内存的空闲页用到这条水位线以下 */
+#define NORMAL_WATERMARK_RATIO 16
+
+
+/* 一次释放的页数超过此值时,直接重新加载cr3刷新整个TLB,不再逐页invlpg */
+#define TLB_FLUSH_ALL_THRESHOLD 32
+
+/* 页框标志 */
+#define PG_BUDDY 1    // 该页框是伙伴系统中某个空闲块的首页
+#define PG_RESERVED 2 // 该页框不可用(物理内存的空洞),不归伙伴系统管理
+#define PG_USER 4     // 该页框由用户进程占用,释放时据此记账
+#define PG_HIGHMEM 8  // 该页框属于高端内存
+
 #define PDE_IDX(addr) ((addr & 0xffc00000) >> 22)
 #define PTE_IDX(addr) ((addr & 0x003ff000) >> 12)
 
-/* 0xc0000000是内核从虚拟地址3G起. 0x100000意指跨过低端1M内存,使虚拟地址在逻辑上连续 */
-#define K_HEAP_START 0xc0100000
+/* 0xc0000000是内核从虚拟地址3G起. K_DIRECT_MAX_PHY以下的物理内存是低端内存,
+ * 全部用4M大页线性映射到K_DIRECT_BASE起,保证直接映射区之后还留有内核堆的空间 */
+#define K_DIRECT_MAX_PHY 0x20000000
+#define BIG_PAGE_SIZE 0x400000
+
+/* 内核堆的虚拟地址上限,最后两个页目录项不给内核堆用 */
+#define K_HEAP_VADDR_END 0xff800000
+
+/* 临时映射窗口:倒数第二个页目录项管辖的4M,页表由loader建好,每个页表项是一个槽位 */
+#define KMAP_VADDR_BASE K_HEAP_VADDR_END
+#define KMAP_SLOTS 1024
+
+/* 物理页框描述符,每个物理页框对应一个,伙伴系统用它来管理物理内存 */
+struct page
+{
+    struct list_elem free_elem; // 空闲时作为free_area[order]链表中的结点
+    uint8_t order;              // 空闲块的阶,只对空闲块的首页有效
+    uint8_t flags;              // 页框标志,如PG_BUDDY
+    uint16_t ref_cnt;           // 映射了此页框的页表项个数,fork后父子进程共享页框时大于1
+    struct arena *arena;        // 页框在内核堆的arena中时指向arena的元信息,block2arena据此找到内存块所在的arena
+};
+
+/* 伙伴系统中某一阶的空闲块链表 */
+struct free_area
+{
+    struct list free_list; // 2^order页大小的空闲块,链表结点是空闲块首页的page
+    uint32_t nr_free;      // 本阶空闲块的数量
+};
+
+/* loader通过BIOS 0xe820子功能得到的地址范围描述符(ARDS) */
+struct ards
+{
+    uint32_t base_low;
+    uint32_t base_high;
+    uint32_t length_low;
+    uint32_t length_high;
+    uint32_t type;
+};
+
+/* 一段可用的物理内存[start, end),按页对齐 */
+struct mem_region
+{
+    uint32_t start;
+    uint32_t end;
+};
+
+/* 物理内存区 */
+enum zone_type
+{
+    ZONE_NORMAL, // 低端内存,在直接映射区中,内核只能用这部分
+    ZONE_HIGH,   // 高端内存,只能通过页表访问,只给用户进程用
+    ZONE_CNT
+};
 
-/* 内存池结构,生成两个实例用于管理内核内存池和用户内存池 */
+/* 物理内存区结构,各有一套伙伴系统。页框不再按内核和用户对半划分,两者共用所有zone */
+struct zone
+{
+    uint32_t start_pfn;                              // 本区第一个页框号
+    uint32_t end_pfn;                                // 本区最后一个页框号之后,高端内存的起点按4M对齐,伙伴块不会跨区
+    struct free_area free_area[BUDDY_MAX_ORDER + 1]; // 伙伴系统各阶的空闲块链表
+    uint32_t managed_pages;                          // 本区交给伙伴系统管理的页框数
+    uint32_t free_pages;                             // 伙伴系统中的空闲页框数,不含预先清0的
+    uint32_t watermark;                              // 用户进程从本区分配后,空闲页(含预先清0的)不能少于此值
+    struct list zeroed_list;                         // idle线程预先清0的页框,链表结点是page的free_elem
+    uint32_t zeroed_cnt;                             // zeroed_list中的页框数
+};
+
+/* 内存使用者结构,生成两个实例,分别记录内核和用户进程的用量 */
 struct pool
 {
-    struct bitmap pool_bitmap; // 本内存池用到的位图结构,用于管理物理内存
-    uint32_t phy_addr_start;   // 本内存池所管理物理内存的起始地址
-    uint32_t pool_size;        // 本内存池字节容量
-    struct lock lock;          // 申请内存时互斥
+    uint32_t total_pages;                            // 能分到的页框上限
+    uint32_t used_pages;                             // 占用的页框数
+    uint32_t peak_pages;                             // used_pages的最大值
+    uint32_t large_cnt;                              // kmalloc按页分配出去的大块内存个数
+    uint32_t large_pages;                            // 这些大块内存占的页数
+    struct lock lock;                                // 申请内存时互斥
 };
 
 /* 内存仓库arena元信息 */
@@ -37,11 +126,26 @@ struct arena
     /* large为ture时,cnt表示的是页框数，否则cnt表示空闲mem_block数量 */
     uint32_t cnt;
     bool large;
+    uint32_t carved;             // 已经切出来用过的内存块数,下标不小于它的块还从没分配过
+    struct list free_list;       // 本arena中被释放回来的mem_block
+    struct list_elem arena_elem; // 还有空闲块时,作为desc->arena_list的结点
 };
 
 struct mem_block_desc k_block_descs[DESC_CNT]; // 内核内存块描述符数组
-struct pool kernel_pool, user_pool;            // 生成内核内存池和用户内存池
+struct pool kernel_pool, user_pool;            // 内核和用户进程两个内存使用者
+static struct zone zones[ZONE_CNT];            // 低端内存和高端内存
+static struct page *page_descs;                // 从物理地址0起每个页框的描述符,下标就是页框号
+static uint32_t page_desc_cnt;                 // page_descs的元素个数
 struct virtual_addr kernel_vaddr;              // 此结构是用来给内核分配虚拟地址
+static uint32_t k_direct_end;                  // 直接映射区末尾的虚拟地址,4M对齐,内核堆紧跟其后
+static uint8_t kmap_bits[KMAP_SLOTS / 8];
+static struct bitmap kmap_bitmap;              // 临时映射窗口中槽位的占用情况
+
+static struct mem_region mem_regions[ARDS_MAX]; // 可用物理内存段,按起始地址从低到高排列
+static uint32_t mem_region_cnt;
+
+static void *pages_populate(enum pool_flags pf, void *vaddr_start, uint32_t pg_cnt);
+static bool vaddr_remove(enum pool_flags pf, void *_vaddr, uint32_t pg_cnt);
 
 /*
 	Description:
@@ -53,12 +157,12 @@ struct virtual_addr kernel_vaddr;              // 此结构是用来给内核分
 		返回申请到的虚拟页起始地址
 		return null if failed
 	Detail:
-		把虚拟地址池的位图中的位，修改为1
+		内核: 把虚拟地址池的位图中的位，修改为1
+		用户: 在进程的vma树中找一段空隙预留下来
 */
 static void *vaddr_get(enum pool_flags pf, uint32_t pg_cnt)
 {
     int vaddr_start = 0, bit_idx_start = -1;
-    uint32_t cnt = 0;
     if (pf == PF_KERNEL) // 内核虚拟地址池
     {
         // 查找 虚拟地址池 的位图，是否有连续的pg_cnt位值为0（值为0表示该虚拟地址可用）
@@ -67,29 +171,18 @@ static void *vaddr_get(enum pool_flags pf, uint32_t pg_cnt)
         {
             return NULL;
         }
-        while (cnt < pg_cnt)
-        {
-            bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 1);
-        }
+        bitmap_set_range(&kernel_vaddr.vaddr_bitmap, bit_idx_start, pg_cnt, 1);
         vaddr_start = kernel_vaddr.vaddr_start + bit_idx_start * PG_SIZE;
     }
-    else // 用户虚拟地址池
+    else // 用户虚拟地址空间
     {
+        // 在用户3级栈之下找第一段足够大的空隙,预留成vma
         struct task_struct *cur = running_thread();
-        bit_idx_start = bitmap_scan(&cur->userprog_vaddr.vaddr_bitmap, pg_cnt);
-        if (bit_idx_start == -1)
+        vaddr_start = vma_find_gap(&cur->vmas, USER_VADDR_START, USER_STACK3_VADDR, pg_cnt * PG_SIZE);
+        if (vaddr_start == 0 || vma_insert(&cur->vmas, vaddr_start, vaddr_start + pg_cnt * PG_SIZE, 0) == -1)
         {
             return NULL;
         }
-
-        while (cnt < pg_cnt)
-        {
-            bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 1);
-        }
-        vaddr_start = cur->userprog_vaddr.vaddr_start + bit_idx_start * PG_SIZE;
-
-        /* (0xc0000000 - PG_SIZE)做为用户3级栈已经在start_process被分配 */
-        ASSERT((uint32_t)vaddr_start < (0xc0000000 - PG_SIZE));
     }
     return (void *)vaddr_start;
 }
@@ -142,324 +235,805 @@ uint32_t *pde_ptr(uint32_t vaddr)
     return pde;
 }
 
+/* 把空闲块pg(2^order页)挂到zone的伙伴系统的空闲链表上,调用者需保证已关中断 */
+static void buddy_add_free(struct zone *z, struct page *pg, uint8_t order)
+{
+    pg->order = order;
+    pg->flags |= PG_BUDDY;
+    list_push(&z->free_area[order].free_list, &pg->free_elem);
+    z->free_area[order].nr_free++;
+    z->free_pages += 1 << order;
+}
+
 /*
-    Description: 
-        在m_pool(kernel_pool 或者 user_pool)指向的物理内存池中分配1个物理页
+    Description:
+        从zone的伙伴系统中分配一个2^order页的物理块
     Parameters:
-        m_pool: struct pool*, the target memery pool
+        z: struct zone*。目标物理内存区
+        order: uint8_t。块的阶
     Return:
-        return physical address of page allcated if succeed
+        块首页的页框描述符
         return NULL if failed
+    Details:
+        - 从order阶开始往上找第一个非空的空闲链表,单页分配时通常第一次就能命中,即O(1)
+        - 找到的块比需要的大时,不断对半拆分,后一半挂回低一阶的链表,最多拆BUDDY_MAX_ORDER次
 */
-static void *palloc(struct pool *m_pool)
+static struct page *buddy_alloc(struct zone *z, uint8_t order)
 {
-    /* 扫描或设置位图要保证原子操作 */
-    int bit_idx = bitmap_scan(&m_pool->pool_bitmap, 1); // 找一个物理页面
-    if (bit_idx == -1)
+    /* 有的调用者不持有锁(如进程退出时释放页框),所以这里用关中断保证原子操作 */
+    enum intr_status old_status = intr_disable();
+    uint8_t cur_order = order;
+    while (cur_order <= BUDDY_MAX_ORDER && z->free_area[cur_order].nr_free == 0)
+    {
+        cur_order++;
+    }
+    if (cur_order > BUDDY_MAX_ORDER)
     {
+        intr_set_status(old_status);
         return NULL;
     }
-    bitmap_set(&m_pool->pool_bitmap, bit_idx, 1); // 将此位bit_idx置1
-    uint32_t page_phyaddr = ((bit_idx * PG_SIZE) + m_pool->phy_addr_start);
-    return (void *)page_phyaddr;
+
+    struct page *pg = elem2entry(struct page, free_elem, list_pop(&z->free_area[cur_order].free_list));
+    z->free_area[cur_order].nr_free--;
+    z->free_pages -= 1 << cur_order;
+    pg->flags &= ~PG_BUDDY;
+
+    // 把多余的部分逐级拆开归还
+    while (cur_order > order)
+    {
+        cur_order--;
+        buddy_add_free(z, pg + (1 << cur_order), cur_order);
+    }
+    intr_set_status(old_status);
+    return pg;
 }
 
 /*
     Description:
-        建立虚拟地址和物理地址的连接，即填充页表和页目录表
-    Parameters:
-        _vaddr: void*, 虚拟地址
-        _page_phyaddr: void* 某一页的物理地址
+        把首页为pg的2^order页物理块归还给zone的伙伴系统
+    Details:
+        块和它的伙伴(页框号只差第order位)都空闲且同阶时合并成高一阶的块,
+        一直合并到伙伴不空闲或者到达最大阶为止
 */
-static void page_table_add(void *_vaddr, void *_page_phyaddr)
+static void buddy_free(struct zone *z, struct page *pg, uint8_t order)
 {
-    uint32_t vaddr = (uint32_t)_vaddr, page_phyaddr = (uint32_t)_page_phyaddr;
-
-    // 构建出了两个虚拟地址，pde和pte，这两个虚拟地址可以访问到vaddr必经的 页目录表项 和 页表项
-    uint32_t *pde = pde_ptr(vaddr);
-    uint32_t *pte = pte_ptr(vaddr);
-
-    /* 先在页目录内判断目录项的P位，若为1,则表示该表已存在 */
-    if (*pde & 0x00000001)
+    enum intr_status old_status = intr_disable();
+    ASSERT(!(pg->flags & PG_BUDDY));
+    uint32_t pfn = pg - page_descs;
+    while (order < BUDDY_MAX_ORDER)
     {
-        ASSERT(!(*pte & 0x00000001));
-        // 检测页目录表的P位
-        if (!(*pte & 0x00000001))
-        {                                                       // 只要是创建页表,pte就应该不存在,多判断一下放心
-            *pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1); // US=1,RW=1,P=1
+        uint32_t buddy_pfn = pfn ^ (1 << order);
+        if (buddy_pfn < z->start_pfn || buddy_pfn >= z->end_pfn)
+        {
+            break;
         }
-        else
-        { // 调试模式下不会执行到此,上面的ASSERT会先执行.关闭调试时下面的PANIC会起作用
-            PANIC("pte repeat");
+        struct page *buddy = page_descs + buddy_pfn;
+        if (!(buddy->flags & PG_BUDDY) || buddy->order != order)
+        {
+            break;
         }
+        // 伙伴空闲,把伙伴摘下来,合并成高一阶的块
+        list_remove(&buddy->free_elem);
+        z->free_area[order].nr_free--;
+        z->free_pages -= 1 << order;
+        buddy->flags &= ~PG_BUDDY;
+        pfn &= ~(1 << order);
+        order++;
     }
-    else
-    { // 页目录项不存在,所以要先创建页目录项再创建页表项.
-        /* 页表中用到的页框一律从内核空间分配 */
-        uint32_t pde_phyaddr = (uint32_t)palloc(&kernel_pool);
-        *pde = (pde_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
+    buddy_add_free(z, page_descs + pfn, order);
+    intr_set_status(old_status);
+}
 
-        /*******************   必须将页表所在的页清0   *********************
-        * 必须把分配到的物理页地址pde_phyaddr对应的物理内存清0,
-        * 避免里面的陈旧数据变成了页表中的页表项,从而让页表混乱.
-        * pte的高20位会映射到pde所指向的页表的物理起始地址.*/
-        memset((void *)((int)pte & 0xfffff000), 0, PG_SIZE);
-        /************************************************************/
-        ASSERT(!(*pte & 0x00000001));
-        *pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1); // US=1,RW=1,P=1
+/* 把页框号[pfn, pfn_end)的页框切成尽量大的对齐块挂到zone的伙伴系统的空闲链表上 */
+static void buddy_add_range(struct zone *z, uint32_t pfn, uint32_t pfn_end)
+{
+    uint32_t idx;
+    for (idx = pfn; idx < pfn_end; idx++)
+    {
+        page_descs[idx].flags &= ~PG_RESERVED;
+        page_descs[idx].ref_cnt = 0;
+    }
+    z->managed_pages += pfn_end - pfn;
+    while (pfn < pfn_end)
+    {
+        // 块的起始页框号必须按块大小对齐,块也不能超出这段内存
+        uint8_t order = BUDDY_MAX_ORDER;
+        while ((pfn & ((1 << order) - 1)) || pfn + (1 << order) > pfn_end)
+        {
+            order--;
+        }
+        buddy_add_free(z, page_descs + pfn, order);
+        pfn += 1 << order;
     }
 }
 
 /*
     Description:
-        分配page_cnt页空间
-    Detail:
-        包括三个步骤：分配虚拟地址、分配物理内存地址、建立虚拟地址和物理地址连接
+        初始化物理内存区z及其伙伴系统
     Parameters:
-        pf: enum pool_flags 物理内存池标志，标识着是内核物理内存池还是用户物理内存池
-        pg_cnt: uint32_t 要申请的页数
-    Return:
-        vaddr_start: void* 申请成功后的虚拟地址
-        return NULL if failed
+        z: struct zone* 要初始化的物理内存区
+        start_pfn, end_pfn: uint32_t 本区的页框号范围
+        usable_start: uint32_t 可分配的最低物理地址,低于它的页框已被占用
+    Details:
+        页框描述符已全部标记为不可用,这里只把和可用物理内存段重叠的部分交给伙伴系统。
+        空洞中的页框不带PG_BUDDY标志,所以伙伴合并时不会越过空洞
 */
-void *malloc_page(enum pool_flags pf, uint32_t pg_cnt)
+static void zone_init(struct zone *z, uint32_t start_pfn, uint32_t end_pfn, uint32_t usable_start)
 {
-    ASSERT(pg_cnt > 0 && pg_cnt < 3840);
-    /***********   malloc_page的原理是三个动作的合成:   ***********
-      1通过vaddr_get在虚拟内存池中申请虚拟地址
-      2通过palloc在物理内存池中申请物理页
-      3通过page_table_add将以上两步得到的虚拟地址和物理地址在页表中完成映射
-    ***************************************************************/
-    void *vaddr_start = vaddr_get(pf, pg_cnt);
-    if (vaddr_start == NULL)
+    uint32_t idx;
+    uint8_t order;
+    z->start_pfn = start_pfn;
+    z->end_pfn = end_pfn;
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++)
     {
-        return NULL;
+        list_init(&z->free_area[order].free_list);
+        z->free_area[order].nr_free = 0;
     }
-    uint32_t vaddr = (uint32_t)vaddr_start, cnt = pg_cnt;
-    struct pool *mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
-
-    /* 因为虚拟地址是连续的,但物理地址可以是不连续的,所以逐个做映射*/
-    while (cnt-- > 0)
+    list_init(&z->zeroed_list);
+    z->zeroed_cnt = 0;
+    z->managed_pages = 0;
+    z->free_pages = 0;
+    z->watermark = 0;
+    for (idx = 0; idx < mem_region_cnt; idx++)
     {
-        void *page_phyaddr = palloc(mem_pool);
-
-        // 失败时要将曾经已申请的虚拟地址和物理页全部回滚，在将来完成内存回收时再补充
-        if (page_phyaddr == NULL)
+        uint32_t start = mem_regions[idx].start, end = mem_regions[idx].end;
+        if (start < usable_start)
         {
-            return NULL;
+            start = usable_start;
+        }
+        if (start < start_pfn * PG_SIZE)
+        {
+            start = start_pfn * PG_SIZE;
+        }
+        if (end > end_pfn * PG_SIZE)
+        {
+            end = end_pfn * PG_SIZE;
+        }
+        if (start < end)
+        {
+            buddy_add_range(z, start / PG_SIZE, end / PG_SIZE);
         }
-         // 填充页目录表项和页表项
-        page_table_add((void *)vaddr, page_phyaddr); // 在页表中做映射
-        vaddr += PG_SIZE;                            // 下一个虚拟页
     }
-    return vaddr_start;
+}
+
+/* 从z的预清零页链表中取一个页框,链表为空时返回NULL */
+static struct page *prezeroed_take(struct zone *z)
+{
+    struct page *pg = NULL;
+    enum intr_status old_status = intr_disable();
+    if (z->zeroed_cnt > 0)
+    {
+        pg = elem2entry(struct page, free_elem, list_pop(&z->zeroed_list));
+        z->zeroed_cnt--;
+    }
+    intr_set_status(old_status);
+    return pg;
+}
+
+/* 页框描述符转换成物理地址 */
+static uint32_t page2phy(struct page *pg)
+{
+    return (pg - page_descs) * PG_SIZE;
+}
+
+/* 物理地址转换成页框描述符 */
+static struct page *phy2page(uint32_t pg_phy_addr)
+{
+    uint32_t pfn = pg_phy_addr / PG_SIZE;
+    ASSERT(pfn < page_desc_cnt);
+    return page_descs + pfn;
+}
+
+/* 页框所在的物理内存区,初始化时已记在页框标志中 */
+static struct zone *page_zone(struct page *pg)
+{
+    return &zones[pg->flags & PG_HIGHMEM ? ZONE_HIGH : ZONE_NORMAL];
 }
 
 /*
     Description:
-        从内核内存空间中分配pg_cnt页(包括虚拟地址和物理内存以及之间的页表映射)
+        按内存使用者pf从合适的zone中取一个2^order页的块,还没有记账
     Parameters:
-        pg_cnt: uint32_t 要申请的页数
-    Return:
-        vaddr: 成功申请空间后，返回的虚拟地址
-        return NULL if failed
+        zeroed: bool* 不为NULL时先取预先清0的页框(只用于单页),并返回取到的是否已清0
+    Details:
+        - 内核的页框都要在直接映射区中,只能用低端内存
+        - 用户进程的页框只通过页表访问,先用高端内存,不够了再用低端内存,
+          但不能把低端内存的空闲页用到水位线以下,剩下的留给只能用低端内存的内核
+        - 伙伴系统空了时,单页分配也可以用预先清0的页框
 */
-void *get_kernel_pages(uint32_t pg_cnt)
+static struct page *zone_alloc(enum pool_flags pf, uint8_t order, bool *zeroed)
 {
-    lock_acquire(&kernel_pool.lock);
-    void *vaddr = malloc_page(PF_KERNEL, pg_cnt);
-    if (vaddr != NULL)
-    { // 若分配的地址不为空,将页框清0后返回
-        memset(vaddr, 0, pg_cnt * PG_SIZE);
+    struct page *pg = NULL;
+    int32_t zone_idx = pf == PF_USER ? ZONE_HIGH : ZONE_NORMAL;
+    if (zeroed != NULL)
+    {
+        *zeroed = false;
     }
-    lock_release(&kernel_pool.lock);
-    return vaddr;
+    for (; zone_idx >= ZONE_NORMAL && pg == NULL; zone_idx--)
+    {
+        struct zone *z = &zones[zone_idx];
+        enum intr_status old_status = intr_disable();
+        if (pf == PF_KERNEL || z->free_pages + z->zeroed_cnt >= z->watermark + (1 << order))
+        {
+            if (zeroed != NULL && (pg = prezeroed_take(z)) != NULL)
+            {
+                *zeroed = true;
+            }
+            if (pg == NULL)
+            {
+                pg = buddy_alloc(z, order);
+            }
+            if (pg == NULL && order == 0)
+            {
+                pg = prezeroed_take(z);
+            }
+        }
+        intr_set_status(old_status);
+    }
+    return pg;
 }
 
-/* 在用户空间中申请4k内存,并返回其虚拟地址 */
-void *get_user_pages(uint32_t pg_cnt)
+/* 把从pg起的pg_cnt个页框记到内存使用者pf名下,每页的引用计数置为1 */
+static void frames_charge(enum pool_flags pf, struct page *pg, uint32_t pg_cnt)
 {
-    lock_acquire(&user_pool.lock);
-    void *vaddr = malloc_page(PF_USER, pg_cnt);
-    if (vaddr != NULL)
-    { // 若分配的地址不为空,将页框清0后返回
-        memset(vaddr, 0, pg_cnt * PG_SIZE);
+    struct pool *mem_pool = pf == PF_KERNEL ? &kernel_pool : &user_pool;
+    uint32_t idx;
+    enum intr_status old_status = intr_disable();
+    for (idx = 0; idx < pg_cnt; idx++)
+    {
+        pg[idx].ref_cnt = 1;
+        if (pf == PF_USER)
+        {
+            pg[idx].flags |= PG_USER;
+        }
+        else
+        {
+            pg[idx].flags &= ~PG_USER;
+        }
     }
-    lock_release(&user_pool.lock);
-    return vaddr;
+    mem_pool->used_pages += pg_cnt;
+    if (mem_pool->used_pages > mem_pool->peak_pages)
+    {
+        mem_pool->peak_pages = mem_pool->used_pages;
+    }
+    intr_set_status(old_status);
 }
 
 /*
     Description: 
-        已知虚拟地址vaddr，申请物理内存，并建立映射
-    Details:
-        已知了虚拟地址vaddr，所以剩下两个步骤：
-            - 申请物理内存 palloc
-            - 建立虚拟地址和物理内存的连接  page_table_add
+        给内存使用者pf分配1个物理页
     Parameters:
-        pf: 内核内存池或者用户内存池
-        vaddr:  已知的虚拟地址 given virtual address
+        pf: enum pool_flags, 内核还是用户进程
     Return:
-        vaddr: 和传递进来的参数一样
+        return physical address of page allcated if succeed
+        return NULL if failed
 */
-void *get_a_page(enum pool_flags pf, uint32_t vaddr)
+static void *palloc(enum pool_flags pf)
 {
-    struct pool *mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
-    lock_acquire(&mem_pool->lock);
-
-    /* 先将虚拟地址对应的位图置1 */
-    struct task_struct *cur = running_thread();
-    int32_t bit_idx = -1;
-
-    /* 若当前是用户进程申请用户内存,就修改用户进程自己的虚拟地址位图 */
-    if (cur->pgdir != NULL && pf == PF_USER)
-    {
-        bit_idx = (vaddr - cur->userprog_vaddr.vaddr_start) / PG_SIZE;
-        ASSERT(bit_idx > 0);
-        bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx, 1);
-    }
-    else if (cur->pgdir == NULL && pf == PF_KERNEL)
-    {
-        /* 如果是内核线程申请内核内存,就修改kernel_vaddr. */
-        bit_idx = (vaddr - kernel_vaddr.vaddr_start) / PG_SIZE;
-        ASSERT(bit_idx > 0);
-        bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx, 1);
-    }
-    else
+    struct page *pg = zone_alloc(pf, 0, NULL);
+    if (pg == NULL)
     {
-        PANIC("get_a_page:not allow kernel alloc userspace or user alloc kernelspace by get_a_page");
+        return NULL;
     }
+    frames_charge(pf, pg, 1);
+    return (void *)page2phy(pg);
+}
 
-    void *page_phyaddr = palloc(mem_pool);
-    if (page_phyaddr == NULL)
+/*
+    Description:
+        给内存使用者pf分配1个物理页,优先从idle线程预先清0的页框中取
+    Parameters:
+        pf: enum pool_flags, 内核还是用户进程
+        zeroed: bool*, 返回分到的页框是否已经清0,没有清0的由调用者映射后自己清0
+    Return:
+        return physical address of page allcated if succeed
+        return NULL if failed
+*/
+static void *palloc_zeroed(enum pool_flags pf, bool *zeroed)
+{
+    struct page *pg = zone_alloc(pf, 0, zeroed);
+    if (pg == NULL)
     {
-        lock_release(&mem_pool->lock);
         return NULL;
     }
-    page_table_add((void *)vaddr, page_phyaddr);
-    lock_release(&mem_pool->lock);
-    return (void *)vaddr;
+    frames_charge(pf, pg, 1);
+    return (void *)page2phy(pg);
 }
 
 /*
     Description:
-        根据虚拟地址vaddr，给该虚拟地址分配1个物理页
-        主要是在实现fork时，子进程的虚拟地址要和父进程的虚拟地址相同，
-        因此子进程的虚拟地址是已知，需要操作物理地址池，不用操作虚拟地址池
-    Parameters:
-        pf: enum pool_flags: 物理内存池标志
-        vaddr: uint32_t 虚拟地址
+        给内存使用者pf分配物理地址连续的pg_cnt个页框
     Return:
-        vaddr：虚拟地址
+        return physical address of the first page if succeed
+        return NULL if failed
     Details:
-        申请1个物理页，然后建立虚拟地址vaddr 和 新建物理页 的页表映射
+        先分配一个能容纳pg_cnt页的2^order页块,再把多出来的尾部按对齐块还给伙伴系统。
+        分配出去的每一页以后都可以单独用pfree释放,释放时会和伙伴重新合并
 */
-void *get_a_page_without_opvaddrbitmap(enum pool_flags pf, uint32_t vaddr)
+static void *palloc_contig(enum pool_flags pf, uint32_t pg_cnt)
 {
-    struct pool *mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
-    lock_acquire(&mem_pool->lock);
-    void *page_phyaddr = palloc(mem_pool);
-    if (page_phyaddr == NULL)
+    uint8_t order = 0;
+    while ((1U << order) < pg_cnt)
+    {
+        order++;
+    }
+    if (order > BUDDY_MAX_ORDER)
     {
-        lock_release(&mem_pool->lock);
         return NULL;
     }
-    page_table_add((void *)vaddr, page_phyaddr);
-    lock_release(&mem_pool->lock);
-    return (void *)vaddr;
+    struct page *pg = zone_alloc(pf, order, NULL);
+    if (pg == NULL)
+    {
+        return NULL;
+    }
+
+    struct zone *z = page_zone(pg);
+    uint32_t idx = pg_cnt, end = 1 << order;
+    while (idx < end)
+    {
+        // idx按其最低位的1对齐,以此作为归还块的阶,块不会越过end
+        uint8_t tail_order = 0;
+        while (!(idx & (1 << tail_order)))
+        {
+            tail_order++;
+        }
+        buddy_free(z, pg + idx, tail_order);
+        idx += 1 << tail_order;
+    }
+    frames_charge(pf, pg, pg_cnt);
+    return (void *)page2phy(pg);
 }
 
-/* 得到虚拟地址映射到的物理地址 */
-uint32_t addr_v2p(uint32_t vaddr)
+/* 判断内核虚拟地址vaddr是否在直接映射区中 */
+static bool in_direct_map(uint32_t vaddr)
 {
-    uint32_t *pte = pte_ptr(vaddr);
-    /* (*pte)的值是页表所在的物理页框地址,
- * 去掉其低12位的页表项属性+虚拟地址vaddr的低12位 */
-    return ((*pte & 0xfffff000) + (vaddr & 0x00000fff));
+    return vaddr >= K_DIRECT_BASE && vaddr < k_direct_end;
 }
 
 /*
     Description:
-        返回arena中下标为idx的内存块的地址
+        从低端内存给内核分配pg_cnt页,直接用直接映射区中的地址,不用修改页表
     Parameters:
-        a: struct arena*。要操作的arena
-        idx: arena下标。目标内存块所在的下标
+        pg_cnt: uint32_t 要申请的页数
+        zero: bool 是否需要清0
     Return:
-        arena 中下标idx的内存块的地址
+        直接映射区中的虚拟地址
+        return NULL if failed
+    Details:
+        单页时优先用idle线程预先清0的页框;多页时要物理连续,从伙伴系统拿一整块。
+        伙伴块按页框号对齐,物理地址0直接映射到K_DIRECT_BASE,所以伙伴块的虚拟地址也按自身大小对齐,
+        所以pg_cnt是2的幂时返回的地址按pg_cnt页对齐
 */
-static struct mem_block *arena2block(struct arena *a, uint32_t idx)
+static void *direct_pages_alloc(uint32_t pg_cnt, bool zero)
 {
-    return (struct mem_block *)((uint32_t)a + sizeof(struct arena) + idx * a->desc->block_size);
+    bool zeroed = false;
+    void *page_phyaddr;
+    if (pg_cnt == 1)
+    {
+        page_phyaddr = zero ? palloc_zeroed(PF_KERNEL, &zeroed) : palloc(PF_KERNEL);
+    }
+    else
+    {
+        page_phyaddr = palloc_contig(PF_KERNEL, pg_cnt);
+    }
+    if (page_phyaddr == NULL)
+    {
+        return NULL;
+    }
+    void *vaddr = phy2kvaddr(page_phyaddr);
+    if (zero && !zeroed)
+    {
+        memset(vaddr, 0, pg_cnt * PG_SIZE);
+    }
+    return vaddr;
 }
 
 /*
-    Descrption:
-        返回内存块b所在的arena地址
-    Parameters:
-        b: struct mem_block*。内存块的地址
+    Description:
+        确保当前页表中[vaddr, vaddr + pg_cnt页)用到的页表都已存在,缺的页表一次性补齐
     Return:
-        内存块b所在的 arena的地址
+        成功返回true,内存不足时返回false,已补上的页表保留,都是空的
     Details:
-        直接高20位取整，因为内存块中1个arena就是1个物理页
+        每个页目录项只检查一次,缺页表的4M整段一起跳过。
+        页表补齐之后,通过页目录表自映射看到的页表项是连续的,
+        调用者可以从pte_ptr(vaddr)开始顺着指针往后填,中间跨页表也不用再查页目录项
 */
-static struct arena *block2arena(struct mem_block *b)
+static bool page_tables_prepare(uint32_t vaddr, uint32_t pg_cnt)
 {
-    return (struct arena *)((uint32_t)b & 0xfffff000);
+    uint32_t *pde = pde_ptr(vaddr);
+    uint32_t *pde_last = pde_ptr(vaddr + (pg_cnt - 1) * PG_SIZE);
+    for (; pde <= pde_last; pde++)
+    {
+        /* 先在页目录内判断目录项的P位，若为1,则表示该表已存在 */
+        if (*pde & PG_P_1)
+        {
+            ASSERT(!(*pde & PG_PS)); // 4M大页下面没有页表
+            continue;
+        }
+        /* 页表中用到的页框一律从内核空间分配 */
+        bool zeroed;
+        uint32_t pde_phyaddr = (uint32_t)palloc_zeroed(PF_KERNEL, &zeroed);
+        if (pde_phyaddr == 0)
+        {
+            return false;
+        }
+        *pde = (pde_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
+
+        /*******************   必须将页表所在的页清0   *********************
+        * 必须把分配到的物理页地址pde_phyaddr对应的物理内存清0,
+        * 避免里面的陈旧数据变成了页表中的页表项,从而让页表混乱.
+        * 预先清0过的页框就不用再清了 */
+        if (!zeroed)
+        {
+            uint32_t pde_idx = ((uint32_t)pde & 0xfff) / 4;
+            memset(pte_ptr(pde_idx << 22), 0, PG_SIZE);
+        }
+        /************************************************************/
+    }
+    return true;
 }
 
 /*
     Description:
-        在堆中分配size字节的内存空间
+        在当前页表中把从vaddr开始的pg_cnt页的页表项依次设置为pte_vals中的值
     Parameters:
-        size: 需要的内存空间大小
+        vaddr: uint32_t 起始虚拟地址,按页对齐
+        pte_vals: const uint32_t* pg_cnt个完整的页表项(物理页地址+属性位)
+        pg_cnt: uint32_t 页数
     Return:
-        分配后的空间的虚拟地址
+        成功返回true,建页表时内存不足返回false,此时没有填任何页表项
     Details:
-        分配时，有两种情况：
-            - 规格大于1024，那么分配内存按照1个物理页为单位分配
-            - 规格小于1024，就分配内存块mem_block
-        
-        分配内存块mem_block时：
-            - 先取出1个物理页
-            - 然后选择合适的规格，切碎，分成小块mem_block
-            - 把全部小块mem_block串起来成列表
-            - 然后分一块mem_block出去
+        先由page_tables_prepare补齐整段要用的页表,再顺着页表项指针连续填写,
+        不再每页重新计算pde_ptr/pte_ptr。这些页表项原来须不存在
 */
-void *sys_malloc(uint32_t size)
+bool map_range(uint32_t vaddr, const uint32_t *pte_vals, uint32_t pg_cnt)
 {
-    enum pool_flags PF;
-    struct pool *mem_pool;
-    uint32_t pool_size;
-
-        // 内存块描述符表（里面是不同规格的内存块描述符）
-    struct mem_block_desc *descs;
-    struct task_struct *cur_thread = running_thread();
-
-    /***********1. 找出要操作的物理内存池************/
-
-    if (cur_thread->pgdir == NULL)
-    { 
-        // 若为内核线程
-        PF = PF_KERNEL;
-        pool_size = kernel_pool.pool_size;
-        mem_pool = &kernel_pool;
+    ASSERT(vaddr % PG_SIZE == 0 && pg_cnt > 0);
+    if (!page_tables_prepare(vaddr, pg_cnt))
+    {
+        return false;
+    }
+    uint32_t *pte = pte_ptr(vaddr);
+    uint32_t idx;
+    for (idx = 0; idx < pg_cnt; idx++)
+    {
+        ASSERT(!(pte[idx] & PG_P_1)); // 只要是新建映射,pte就应该不存在
+        pte[idx] = pte_vals[idx];
+    }
+    return true;
+}
 
-        // 内核 内存块描述符表
-        descs = k_block_descs;
+/*
+    Description:
+        在当前页表中把虚拟地址_vaddr的页表项设置为pte_val,页表不存在时先创建页表
+    Parameters:
+        _vaddr: void*, 虚拟地址
+        pte_val: uint32_t 完整的页表项(物理页地址+属性位)
+    Details:
+        一次只映射一页,连续的多页用map_range
+*/
+void page_table_add_pte(void *_vaddr, uint32_t pte_val)
+{
+    if (!map_range((uint32_t)_vaddr, &pte_val, 1))
+    {
+        PANIC("page_table_add_pte: no memory for page table");
     }
-    else
-    { 
-        // 用户进程pcb中的pgdir会在为其分配页表时创建
-        PF = PF_USER;
-        pool_size = user_pool.pool_size;
-        mem_pool = &user_pool;
+}
 
-        // 用户进程独立的内存块描述符表
-        descs = cur_thread->u_block_desc;
+/*
+    Description:
+        在页目录pgdir(不必是当前页目录)中把从vaddr开始的pg_cnt页的页表项依次设置为pte_vals中的值
+    Parameters:
+        pgdir: uint32_t* 页目录的内核虚拟地址
+        vaddr: uint32_t 用户空间的起始虚拟地址,按页对齐
+        pte_vals: const uint32_t* pg_cnt个完整的页表项
+        pg_cnt: uint32_t 页数
+    Return:
+        成功返回true,建页表时内存不足返回false,此时没有填任何页表项
+    Details:
+        和map_range一样先补齐页表再填页表项,但不经过页目录表自映射,不用切换cr3。
+        页表的页框都在低端内存,通过kmap直接得到直接映射区中的地址
+*/
+bool pgdir_map_range(uint32_t *pgdir, uint32_t vaddr, const uint32_t *pte_vals, uint32_t pg_cnt)
+{
+    ASSERT(vaddr % PG_SIZE == 0 && pg_cnt > 0 && vaddr + pg_cnt * PG_SIZE <= K_DIRECT_BASE);
+    uint32_t vaddr_last = vaddr + (pg_cnt - 1) * PG_SIZE;
+    uint32_t pde_idx, pde_last = PDE_IDX(vaddr_last);
+    for (pde_idx = PDE_IDX(vaddr); pde_idx <= pde_last; pde_idx++)
+    {
+        if (pgdir[pde_idx] & PG_P_1)
+        {
+            continue;
+        }
+        bool zeroed;
+        uint32_t pt_phyaddr = (uint32_t)palloc_zeroed(PF_KERNEL, &zeroed);
+        if (pt_phyaddr == 0)
+        {
+            return false;
+        }
+        if (!zeroed)
+        {
+            void *table = kmap(pt_phyaddr);
+            memset(table, 0, PG_SIZE);
+            kunmap(table);
+        }
+        pgdir[pde_idx] = pt_phyaddr | PG_US_U | PG_RW_W | PG_P_1;
     }
 
-    /* 若申请的内存不在内存池容量范围内则直接返回NULL */
-    if (!(size > 0 && size < pool_size))
+    uint32_t idx = 0;
+    while (idx < pg_cnt)
+    {
+        uint32_t *table = kmap(pgdir[PDE_IDX(vaddr)] & 0xfffff000);
+        uint32_t pte_idx;
+        for (pte_idx = PTE_IDX(vaddr); pte_idx < 1024 && idx < pg_cnt; pte_idx++)
+        {
+            ASSERT(!(table[pte_idx] & PG_P_1));
+            table[pte_idx] = pte_vals[idx++];
+            vaddr += PG_SIZE;
+        }
+        kunmap(table);
+    }
+    return true;
+}
+
+/*
+    Description:
+        建立虚拟地址和物理地址的连接，即填充页表和页目录表
+    Parameters:
+        _vaddr: void*, 虚拟地址
+        _page_phyaddr: void* 某一页的物理地址
+*/
+static void page_table_add(void *_vaddr, void *_page_phyaddr)
+{
+    page_table_add_pte(_vaddr, (uint32_t)_page_phyaddr | PG_US_U | PG_RW_W | PG_P_1); // US=1,RW=1,P=1
+}
+
+/*
+    Description:
+        分配page_cnt页空间
+    Detail:
+        包括三个步骤：分配虚拟地址、分配物理内存地址、建立虚拟地址和物理地址连接
+        用户空间只做第一步,物理页等到第一次访问时在缺页异常中分配,见page_fault_fixup
+        内核空间先从直接映射区分配,不用这三步;内核内存池凑不出物理连续的pg_cnt页时才退回内核堆
+    Parameters:
+        pf: enum pool_flags 物理内存池标志，标识着是内核物理内存池还是用户物理内存池
+        pg_cnt: uint32_t 要申请的页数
+    Return:
+        vaddr_start: void* 申请成功后的虚拟地址
+        return NULL if failed
+*/
+void *malloc_page(enum pool_flags pf, uint32_t pg_cnt)
+{
+    ASSERT(pg_cnt > 0 && pg_cnt < 3840);
+    /***********   malloc_page的原理是三个动作的合成:   ***********
+      1通过vaddr_get在虚拟内存池中申请虚拟地址
+      2通过palloc在物理内存池中申请物理页
+      3通过pages_populate先补齐页表,再把以上两步得到的虚拟地址和物理地址连续填进页表项
+    ***************************************************************/
+    if (pf == PF_KERNEL)
+    {
+        void *vaddr = direct_pages_alloc(pg_cnt, false);
+        if (vaddr != NULL)
+        {
+            return vaddr;
+        }
+    }
+    void *vaddr_start = vaddr_get(pf, pg_cnt);
+    if (vaddr_start == NULL)
+    {
+        return NULL;
+    }
+    return pages_populate(pf, vaddr_start, pg_cnt);
+}
+
+/*
+    Description:
+        给已经申请到的虚拟地址vaddr_start起的pg_cnt页分配物理页并建立映射
+    Return:
+        vaddr_start
+        return NULL if failed
+    Details:
+        用户空间不分配,物理页等到第一次访问时在缺页异常中分配。
+        内核空间走到这里说明直接映射区凑不出物理连续的页框,只能逐页分配,
+        中途失败时已分到的页框全部退回,不留下只映射了一半的虚拟地址
+*/
+static void *pages_populate(enum pool_flags pf, void *vaddr_start, uint32_t pg_cnt)
+{
+    if (pf == PF_USER)
+    {
+        return vaddr_start;
+    }
+    uint32_t vaddr = (uint32_t)vaddr_start;
+    if (!page_tables_prepare(vaddr, pg_cnt))
+    {
+        return NULL;
+    }
+
+    /* 因为虚拟地址是连续的,但物理地址可以是不连续的,所以逐页分配页框,
+     * 页表已经补齐,页表项顺着指针连续填写 */
+    uint32_t *pte = pte_ptr(vaddr);
+    uint32_t idx;
+    for (idx = 0; idx < pg_cnt; idx++)
+    {
+        void *page_phyaddr = palloc(pf);
+
+        // 失败时已映射的页框退回去,虚拟地址由调用者处理
+        if (page_phyaddr == NULL)
+        {
+            if (idx > 0)
+            {
+                unmap_range(pf, vaddr, idx);
+            }
+            return NULL;
+        }
+        ASSERT(!(pte[idx] & PG_P_1));
+        pte[idx] = (uint32_t)page_phyaddr | PG_US_U | PG_RW_W | PG_P_1;
+    }
+    return vaddr_start;
+}
+
+/*
+    Description:
+        在内核空间分配pg_cnt页并清0
+    Details:
+        优先从直接映射区分配,单页时用idle线程预先清0的页框,这样分配路径上就不用再花时间清0;
+        凑不出物理连续的页框时退回内核堆逐页映射,再整段清0
+*/
+static void *malloc_kernel_pages_zeroed(uint32_t pg_cnt)
+{
+    void *vaddr = direct_pages_alloc(pg_cnt, true);
+    if (vaddr != NULL)
+    {
+        return vaddr;
+    }
+
+    vaddr = vaddr_get(PF_KERNEL, pg_cnt);
+    if (vaddr == NULL)
+    {
+        return NULL;
+    }
+    if (pages_populate(PF_KERNEL, vaddr, pg_cnt) == NULL)
+    {
+        vaddr_remove(PF_KERNEL, vaddr, pg_cnt);
+        return NULL;
+    }
+    memset(vaddr, 0, pg_cnt * PG_SIZE);
+    return vaddr;
+}
+
+/*
+    Description:
+        从内核内存空间中分配pg_cnt页(包括虚拟地址和物理内存以及之间的页表映射)
+    Parameters:
+        pg_cnt: uint32_t 要申请的页数
+    Return:
+        vaddr: 成功申请空间后，返回的虚拟地址
+        return NULL if failed
+*/
+void *get_kernel_pages(uint32_t pg_cnt)
+{
+    lock_acquire(&kernel_pool.lock);
+    void *vaddr = malloc_kernel_pages_zeroed(pg_cnt); // 分到的页框已清0
+    lock_release(&kernel_pool.lock);
+    return vaddr;
+}
+
+/* 在用户空间中申请4k内存,并返回其虚拟地址.
+ * 这里只预留虚拟地址,页框在第一次访问时才分配,分配时已清0 */
+void *get_user_pages(uint32_t pg_cnt)
+{
+    lock_acquire(&user_pool.lock);
+    void *vaddr = malloc_page(PF_USER, pg_cnt);
+    lock_release(&user_pool.lock);
+    return vaddr;
+}
+
+/* 得到虚拟地址映射到的物理地址,直接映射区中只需减去偏移 */
+uint32_t addr_v2p(uint32_t vaddr)
+{
+    if (in_direct_map(vaddr))
+    {
+        return kvaddr2phy(vaddr);
+    }
+    uint32_t pde = *pde_ptr(vaddr);
+    if (pde & PG_PS)
+    { // 4M大页,页目录项的高10位就是物理地址的高10位
+        return (pde & 0xffc00000) + (vaddr & 0x003fffff);
+    }
+    uint32_t *pte = pte_ptr(vaddr);
+    /* (*pte)的值是页表所在的物理页框地址,
+ * 去掉其低12位的页表项属性+虚拟地址vaddr的低12位 */
+    return ((*pte & 0xfffff000) + (vaddr & 0x00000fff));
+}
+
+/*
+    Description:
+        返回arena中下标为idx的内存块的地址
+    Parameters:
+        a: struct arena*。要操作的arena
+        idx: arena下标。目标内存块所在的下标
+    Return:
+        arena 中下标idx的内存块的地址
+*/
+static struct mem_block *arena2block(struct arena *a, uint32_t idx)
+{
+    return (struct mem_block *)((uint32_t)a + sizeof(struct arena) + idx * a->desc->block_size);
+}
+
+/* 让arena a的前pg_cnt页的页框描述符指向a,内核堆的页都已映射 */
+static void arena_pages_tag(struct arena *a, uint32_t pg_cnt)
+{
+    uint32_t vaddr = (uint32_t)a, idx;
+    for (idx = 0; idx < pg_cnt; idx++, vaddr += PG_SIZE)
+    {
+        phy2page(addr_v2p(vaddr))->arena = a;
+    }
+}
+
+/*
+    Descrption:
+        返回内存块b所在的arena地址
+    Parameters:
+        b: struct mem_block*。内存块的地址
+    Return:
+        内存块b所在的 arena的地址
+        return NULL if not found
+    Details:
+        arena建立时已在页框描述符中记下了arena(见arena_pages_tag),由b所在页的页框直接找到:
+            - 小块arena的每一页都记了,大块内存只记首页,交出去的地址就在首页中
+            - 小块arena的desc要在k_block_descs中
+*/
+static struct arena *block2arena(struct mem_block *b)
+{
+    uint32_t vaddr = (uint32_t)b;
+    if (!in_direct_map(vaddr))
+    {
+        uint32_t pde = *pde_ptr(vaddr);
+        if (!(pde & PG_P_1) || (!(pde & PG_PS) && !(*pte_ptr(vaddr) & PG_P_1)))
+        {
+            return NULL;
+        }
+    }
+    struct arena *a = phy2page(addr_v2p(vaddr))->arena;
+    if (a == NULL)
+    {
+        return NULL;
+    }
+    if (a->large == true)
+    {
+        return a->desc == NULL ? a : NULL;
+    }
+    return a->desc >= k_block_descs && a->desc < k_block_descs + DESC_CNT ? a : NULL;
+}
+
+/*
+    Description:
+        在内核的堆中分配size字节的内存空间,用于内核自己的数据结构,不论当前是内核线程还是用户进程
+    Parameters:
+        size: 需要的内存空间大小
+    Return:
+        分配后的空间的虚拟地址
+    Details:
+        分配时，有两种情况：
+            - 规格大于最大的内存块(16K)，那么分配内存按照1个物理页为单位分配
+            - 规格不超过16K，就分配内存块mem_block
+        
+        分配内存块mem_block时：
+            - 选择合适的规格，从该规格的arena_list中取第一个还有空闲块的arena
+            - 没有的话，就申请arena_pages页做为新arena，只初始化元信息，不切碎
+            - 优先取arena中释放回来的块，没有就切一块从没用过的出去
+            - arena中的块分完了，就从arena_list中摘下
+
+        分到的内存已清0
+*/
+void *kmalloc(uint32_t size)
+{
+    /***********1. 内核的物理内存池和内存块描述符表************/
+    struct pool *mem_pool = &kernel_pool;
+    struct mem_block_desc *descs = k_block_descs;
+
+    /* 若申请的内存超出了能分到的页框上限则直接返回NULL */
+    if (!(size > 0 && size / PG_SIZE < mem_pool->total_pages))
     {
         return NULL;
     }
@@ -469,138 +1043,530 @@ void *sys_malloc(uint32_t size)
 
     /*****************2. 分配内存*************************/
 
-    /********* 超过最大内存块1024, 就以页框为分配单位 ********/
-    if (size > 1024)
+    /********* 超过最大内存块, 就以页框为分配单位 ********/
+    if (size > descs[DESC_CNT - 1].block_size)
     {
         // 那么1个arena就需要page_cnt页
         uint32_t page_cnt = DIV_ROUND_UP(size + sizeof(struct arena), PG_SIZE); // 向上取整需要的页框数
 
-        a = malloc_page(PF, page_cnt);
+        a = malloc_kernel_pages_zeroed(page_cnt);
+        if (a != NULL)
+        {
+            arena_pages_tag(a, 1);
+
+            // 对于分配的大块页框,将desc置为NULL, cnt置为页框数,large置为true
+            a->desc = NULL;
+            a->cnt = page_cnt;
+            a->large = true;
+            mem_pool->large_cnt++;
+            mem_pool->large_pages += page_cnt;
+            lock_release(&mem_pool->lock);
+            return (void *)(a + 1); // 跨过arena大小，把剩下的内存返回
+        }
+        else
+        {
+            lock_release(&mem_pool->lock);
+            return NULL;
+        }
+    }
+        /**************若申请的内存不超过最大内存块 ***********************/
+    else
+    {
+        uint8_t desc_idx;
+
+        // 从内存块描述符中匹配合适的内存块规格
+        for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++)
+        {
+            if (size <= descs[desc_idx].block_size)
+            { 
+                // 从小往大后,找到后退出
+                break;
+            }
+        }
+        struct mem_block_desc *desc = &descs[desc_idx];
+
+        // 在需要的规格中的内存块描述符中的arena列表中，看有没有还有空闲块的arena
+        if (list_empty(&desc->arena_list))
+        {
+            // 如果没有，就申请arena_pages页做为新arena，内存块等分配时再逐个切出来
+            // arena本身不用清0,块在分配出去时再清
+            a = malloc_page(PF_KERNEL, desc->arena_pages);
+            if (a == NULL)
+            {
+                lock_release(&mem_pool->lock);
+                return NULL;
+            }
+            arena_pages_tag(a, desc->arena_pages);
+
+            a->desc = desc;
+            a->large = false;
+            a->cnt = desc->blocks_per_arena;
+            a->carved = 0;
+            desc->arena_cnt++;
+            list_init(&a->free_list);
+            list_push(&desc->arena_list, &a->arena_elem);
+        }
+
+        a = elem2entry(struct arena, arena_elem, desc->arena_list.head.next);
+        if (!list_empty(&a->free_list))
+        {
+            // 先用释放回来的块
+            b = elem2entry(struct mem_block, free_elem, list_pop(&a->free_list));
+        }
+        else
+        {
+            // 再切一块从没用过的
+            ASSERT(a->carved < desc->blocks_per_arena);
+            b = arena2block(a, a->carved++);
+        }
+        memset(b, 0, desc->block_size);
+
+        // 将此arena中的空闲内存块数减1,分完了就不再留在arena_list中
+        if (--a->cnt == 0)
+        {
+            list_remove(&a->arena_elem);
+        }
+        lock_release(&mem_pool->lock);
+        return (void *)b;
+    }
+}
+
+/*
+    Description:
+        把当前进程堆的末尾(program break)调整到new_brk
+    Return:
+        调整后的program break
+        new_brk越界(包括缩到堆的第一页以内)、和别的vma重叠或者内存不足时不调整,返回原来的值;内核线程返回0
+    Details:
+        堆是从USER_HEAP_START开始的VM_HEAP的vma,按页预留到program break所在页的末尾
+        - 变大时只预留新增的整页,页框在第一次访问时才分配,内容为0
+        - 变小时把不再用的整页连同页框一起去掉,以后再长回来也是0
+        用户态分配器自己管理堆中的内存,只在堆不够时才陷入内核调整一次
+*/
+uint32_t sys_brk(uint32_t new_brk)
+{
+    struct task_struct *cur = running_thread();
+    if (cur->pgdir == NULL)
+    {
+        return 0;
+    }
+    uint32_t old_brk = cur->brk;
+    if (new_brk < USER_HEAP_START + PG_SIZE || new_brk > USER_STACK3_VADDR)
+    { // 堆的第一页放着用户态分配器的状态,创建进程时就已预留,不能缩掉
+        return old_brk;
+    }
+    uint32_t old_end = DIV_ROUND_UP(old_brk, PG_SIZE) * PG_SIZE;
+    uint32_t new_end = DIV_ROUND_UP(new_brk, PG_SIZE) * PG_SIZE;
+    if (new_end > old_end && vma_insert(&cur->vmas, old_end, new_end, VM_HEAP) == -1)
+    {
+        return old_brk;
+    }
+    if (new_end < old_end && !mfree_page(PF_USER, (void *)new_end, (old_end - new_end) / PG_SIZE))
+    {
+        return old_brk;
+    }
+    cur->brk = new_brk;
+    return new_brk;
+}
+
+/* 减少页框pg_phy_addr的一个引用,减到0时从占用它的使用者名下销账,
+ * 作为0阶块还给它所在zone的伙伴系统。调用者须已关中断 */
+static void page_put(uint32_t pg_phy_addr)
+{
+    struct page *pg = phy2page(pg_phy_addr);
+    ASSERT(pg->ref_cnt > 0);
+    if (--pg->ref_cnt == 0)
+    {
+        struct pool *mem_pool = pg->flags & PG_USER ? &user_pool : &kernel_pool;
+        mem_pool->used_pages--;
+        pg->flags &= ~PG_USER;
+        pg->arena = NULL;
+        buddy_free(page_zone(pg), pg, 0);
+    }
+}
+
+/*
+    Description:
+        将物理地址pg_phy_addr回收到它所在的zone
+    Details:
+        页框可能被多个页表项共享(写时复制),每次只减少一次引用计数,
+        计数减到0时才真正还给伙伴系统
+*/
+void pfree(uint32_t pg_phy_addr)
+{
+    enum intr_status old_status = intr_disable();
+    page_put(pg_phy_addr);
+    intr_set_status(old_status);
+}
+
+/* 给物理页框pg_phy_addr增加一个引用,在多个页表项共享同一页框时使用 */
+void page_ref_inc(uint32_t pg_phy_addr)
+{
+    struct page *pg = phy2page(pg_phy_addr);
+    enum intr_status old_status = intr_disable();
+    ASSERT(pg->ref_cnt > 0);
+    pg->ref_cnt++;
+    intr_set_status(old_status);
+}
+
+/*
+    Description:
+        fork失败时撤销对当前页表中vaddr处页框的共享,页表项必须存在
+    Details:
+        去掉给子进程加的那个引用。页框只剩自己在用时去掉PG_COW恢复可写,
+        和写时复制缺页中独占的情况一样。调用者随后要刷新TLB
+*/
+void cow_share_undo(uint32_t vaddr)
+{
+    uint32_t *pte = pte_ptr(vaddr);
+    uint32_t pg_phy_addr = *pte & 0xfffff000;
+    struct page *pg = phy2page(pg_phy_addr);
+    enum intr_status old_status = intr_disable();
+    ASSERT(pg->ref_cnt > 1);
+    page_put(pg_phy_addr);
+    if ((*pte & PG_COW) && pg->ref_cnt == 1)
+    {
+        *pte = (*pte & ~PG_COW) | PG_RW_W;
+    }
+    intr_set_status(old_status);
+}
+
+/* 使TLB中虚拟地址vaddr所在页的缓存失效 */
+static void tlb_flush_page(uint32_t vaddr)
+{
+    asm volatile("invlpg (%0)" ::"r"(vaddr)
+                 : "memory");
+}
+
+/*
+    Description:
+        使TLB中从vaddr开始的pg_cnt页的缓存失效
+    Details:
+        页数不多时逐页invlpg;页数超过TLB_FLUSH_ALL_THRESHOLD时,
+        逐页invlpg比整个TLB重新装填还慢,改为重新加载一次cr3
+*/
+static void tlb_flush_range(uint32_t vaddr, uint32_t pg_cnt)
+{
+    if (pg_cnt > TLB_FLUSH_ALL_THRESHOLD)
+    {
+        uint32_t cr3;
+        asm volatile("movl %%cr3, %0" : "=r"(cr3));
+        asm volatile("movl %0, %%cr3" ::"r"(cr3) : "memory");
+        return;
+    }
+    while (pg_cnt-- > 0)
+    {
+        tlb_flush_page(vaddr);
+        vaddr += PG_SIZE;
+    }
+}
+
+/*
+    Description:
+        把物理页框pg_phy_addr临时映射到内核空间,用完须用kunmap去掉映射
+    Return:
+        能访问该页框的内核虚拟地址
+    Details:
+        - 低端内存的页框本来就在直接映射区中,直接返回直接映射区的地址,不占槽位
+        - 高端内存的页框占用临时映射窗口的一个槽位。窗口的页表是所有进程共用的内核页表,
+          持有槽位时被换下去、换回来映射仍然有效,不用关中断;
+          要访问别的进程的页框时也不用切换页表,映射上来直接memcpy即可
+        - 槽位在kunmap时已经刷新过TLB,这里填好页表项就能用
+*/
+void *kmap(uint32_t pg_phy_addr)
+{
+    if (pg_phy_addr < zones[ZONE_HIGH].start_pfn * PG_SIZE)
+    {
+        return phy2kvaddr(pg_phy_addr);
+    }
+    enum intr_status old_status = intr_disable();
+    int32_t slot = bitmap_scan(&kmap_bitmap, 1);
+    if (slot == -1)
+    {
+        PANIC("kmap: no free slot");
+    }
+    bitmap_set(&kmap_bitmap, slot, 1);
+    intr_set_status(old_status);
+
+    uint32_t vaddr = KMAP_VADDR_BASE + slot * PG_SIZE;
+    *pte_ptr(vaddr) = pg_phy_addr | PG_US_S | PG_RW_W | PG_P_1;
+    return (void *)vaddr;
+}
+
+/* 去掉kmap建立的临时映射,直接映射区的地址什么都不用做 */
+void kunmap(void *vaddr)
+{
+    uint32_t addr = (uint32_t)vaddr;
+    if (addr < KMAP_VADDR_BASE)
+    {
+        return;
+    }
+    ASSERT(addr % PG_SIZE == 0 && addr < KMAP_VADDR_BASE + KMAP_SLOTS * PG_SIZE);
+    *pte_ptr(addr) = 0;
+    tlb_flush_page(addr);
+    enum intr_status old_status = intr_disable();
+    bitmap_set(&kmap_bitmap, (addr - KMAP_VADDR_BASE) / PG_SIZE, 0);
+    intr_set_status(old_status);
+}
 
-        if (a != NULL)
+/*
+    Description:
+        去掉当前页表中从vaddr开始的pg_cnt页的映射,把映射的页框还给内存池,并刷新TLB
+    Parameters:
+        pf: enum pool_flags 页框所属的内存使用者
+        vaddr: uint32_t 起始虚拟地址
+        pg_cnt: uint32_t 页数
+    Details:
+        - 每个页表只检查一次页目录项,页目录项不存在时整个页表(4M)一起跳过
+        - 同一个页表中的页表项是连续的,直接顺着指针往后走,不再逐页pte_ptr/addr_v2p
+        - 整段的页表项都清完后用tlb_flush_range一次刷新
+        - 只去掉映射,不释放虚拟地址,也不释放页表
+*/
+void unmap_range(enum pool_flags pf, uint32_t vaddr, uint32_t pg_cnt)
+{
+    uint32_t vaddr_start = vaddr, vaddr_end = vaddr + pg_cnt * PG_SIZE;
+    while (vaddr < vaddr_end)
+    {
+        // 本页表管辖范围的末尾
+        uint32_t table_end = (vaddr & 0xffc00000) + 0x400000;
+        if (table_end > vaddr_end)
         {
-            memset(a, 0, page_cnt * PG_SIZE); // 将分配的内存清0
-
-            // 对于分配的大块页框,将desc置为NULL, cnt置为页框数,large置为true
-            a->desc = NULL;
-            a->cnt = page_cnt;
-            a->large = true;
-            lock_release(&mem_pool->lock);
-            return (void *)(a + 1); // 跨过arena大小，把剩下的内存返回
+            table_end = vaddr_end;
         }
-        else
+        // 用户空间的页是按需分配的,整个页表都可能还没建
+        if (!(*pde_ptr(vaddr) & PG_P_1))
         {
-            lock_release(&mem_pool->lock);
-            return NULL;
+            ASSERT(pf == PF_USER);
+            vaddr = table_end;
+            continue;
         }
-    }
-        /**************若申请的内存小于等于1024 ***********************/
-    else
-    {
-        uint8_t desc_idx;
 
-        // 从内存块描述符中匹配合适的内存块规格
-        for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++)
+        uint32_t *pte = pte_ptr(vaddr);
+        while (vaddr < table_end)
         {
-            if (size <= descs[desc_idx].block_size)
-            { 
-                // 从小往大后,找到后退出
-                break;
+            if (*pte & PG_P_1)
+            {
+                uint32_t pg_phy_addr = *pte & 0xfffff000;
+                // 确保物理地址属于对应的物理内存池
+                ASSERT(!(phy2page(pg_phy_addr)->flags & PG_USER) == (pf == PF_KERNEL));
+                pfree(pg_phy_addr);
+                *pte &= ~PG_P_1; // 将页表项pte的P位置0
             }
-        }
-
-        // 在需要的规格中的内存块描述符中的列表中，看有没有可用的
-        if (list_empty(&descs[desc_idx].free_list))
-        {
-            // 如果没有可用的，就申请1个物理页，然后切碎成mem_block
-            a = malloc_page(PF, 1); // 分配1页框做为arena
-            if (a == NULL)
+            else
             {
-                lock_release(&mem_pool->lock);
-                return NULL;
+                // 只有用户空间会有从没访问过、没有页框的页
+                ASSERT(pf == PF_USER);
             }
-            memset(a, 0, PG_SIZE);
-
-            
-            a->desc = &descs[desc_idx];
-            a->large = false;
-            a->cnt = descs[desc_idx].blocks_per_arena;
-            uint32_t block_idx;
+            pte++;
+            vaddr += PG_SIZE;
+        }
+    }
+    tlb_flush_range(vaddr_start, pg_cnt);
+}
 
-            enum intr_status old_status = intr_disable();
+/*
+    Description:
+        进程退出时把当前页表中用户空间[start, end)映射的页框还给内存池
+    Details:
+        - 页目录项不存在的页表(4M)整个跳过,只走进程真正用到的页表
+        - 每个页表关一次中断,把其中的页框一起归还,不再每个页框开关一次中断
+        - 页表项不清0,页表随后由user_page_tables_release整个释放,也不用刷新TLB
+        - 写时复制共享的页框只减引用计数
+*/
+void user_frames_release(uint32_t start, uint32_t end)
+{
+    uint32_t vaddr = start;
+    while (vaddr < end)
+    {
+        uint32_t table_end = (vaddr & 0xffc00000) + 0x400000;
+        if (table_end > end || table_end == 0)
+        {
+            table_end = end;
+        }
+        if (!(*pde_ptr(vaddr) & PG_P_1))
+        {
+            vaddr = table_end;
+            continue;
+        }
 
-            // 开始将arena拆分成内存块,并添加到内存块描述符的free_list中
-            for (block_idx = 0; block_idx < descs[desc_idx].blocks_per_arena; block_idx++)
+        uint32_t *pte = pte_ptr(vaddr);
+        uint32_t *pte_end = pte + (table_end - vaddr) / PG_SIZE;
+        enum intr_status old_status = intr_disable();
+        while (pte < pte_end)
+        {
+            if (*pte & PG_P_1)
             {
-                b = arena2block(a, block_idx);
-                ASSERT(!elem_find(&a->desc->free_list, &b->free_elem));
-                list_append(&a->desc->free_list, &b->free_elem);
+                ASSERT(phy2page(*pte & 0xfffff000)->flags & PG_USER);
+                page_put(*pte & 0xfffff000);
             }
-            intr_set_status(old_status);
+            pte++;
         }
+        intr_set_status(old_status);
+        vaddr = table_end;
+    }
+}
 
-        // 从可用的内存块链表中，取出一个内存块出来
-        b = elem2entry(struct mem_block, free_elem, list_pop(&(descs[desc_idx].free_list)));
-        memset(b, 0, descs[desc_idx].block_size);
+/* 进程退出时释放当前页目录中用户空间的所有页表,页表中的页框须已由user_frames_release释放 */
+void user_page_tables_release(void)
+{
+    uint32_t *pde = pde_ptr(0);
+    uint32_t *user_pde_end = pde + 768;
+    enum intr_status old_status = intr_disable();
+    while (pde < user_pde_end)
+    {
+        if (*pde & PG_P_1)
+        {
+            page_put(*pde & 0xfffff000);
+            *pde = 0;
+        }
+        pde++;
+    }
+    intr_set_status(old_status);
+}
 
-        a = block2arena(b); // 获取内存块b所在的arena
-        a->cnt--;           // 将此arena中的空闲内存块数减1
-        lock_release(&mem_pool->lock);
-        return (void *)b;
+/* 给当前进程的用户页pg_vaddr分配一个内容全为0的页框并建立映射,不检查vma。
+ * 返回页框的物理地址,内存不足时返回0 */
+uint32_t user_page_alloc_zeroed(uint32_t pg_vaddr)
+{
+    bool zeroed;
+    void *page_phyaddr = palloc_zeroed(PF_USER, &zeroed);
+    if (page_phyaddr == NULL)
+    {
+        return 0;
+    }
+    page_table_add((void *)pg_vaddr, page_phyaddr);
+    if (!zeroed)
+    {
+        memset((void *)pg_vaddr, 0, PG_SIZE);
     }
+    return (uint32_t)page_phyaddr;
 }
 
-/* 将物理地址pg_phy_addr回收到物理内存池 */
-void pfree(uint32_t pg_phy_addr)
+/* 给进程cur中已预留但还没有页框的虚拟地址fault_vaddr分配一个清0的页框 */
+static bool demand_page_fault(struct task_struct *cur, uint32_t fault_vaddr)
 {
-    struct pool *mem_pool;
-    uint32_t bit_idx = 0;
-    if (pg_phy_addr >= user_pool.phy_addr_start)
-    { // 用户物理内存池
-        mem_pool = &user_pool;
-        bit_idx = (pg_phy_addr - user_pool.phy_addr_start) / PG_SIZE;
+    if (vma_find(&cur->vmas, fault_vaddr) == NULL)
+    {
+        return false; // 访问了没申请过的地址
     }
-    else
-    { // 内核物理内存池
-        mem_pool = &kernel_pool;
-        bit_idx = (pg_phy_addr - kernel_pool.phy_addr_start) / PG_SIZE;
+    return user_page_alloc_zeroed(fault_vaddr & 0xfffff000) != 0;
+}
+
+/*
+    Description:
+        处理缺页异常,修复能修复的缺页
+    Parameters:
+        fault_vaddr: uint32_t 引起缺页的虚拟地址(cr2)
+    Return:
+        true: 缺页已修复,返回后重新执行引起异常的指令即可
+        false: 无法修复,由调用者按一般异常处理
+    Details:
+        1. 页表项不存在,但虚拟地址已在进程的vma中预留(堆或者栈):
+            按需分配一个清0的页框映射上去
+        2. 页表项存在且带PG_COW标记,说明是写了fork后共享的只读页
+            - 页框只剩自己在用,直接恢复可写
+            - 否则分配新页框,用kmap临时映射到内核,把旧页内容一次复制过去,再让页表项指向新页框
+*/
+bool page_fault_fixup(uint32_t fault_vaddr)
+{
+    struct task_struct *cur = running_thread();
+    if (cur->pgdir == NULL || fault_vaddr < USER_VADDR_START || fault_vaddr >= USER_STACK3_TOP)
+    {
+        return false;
+    }
+    uint32_t *pte = pte_ptr(fault_vaddr);
+    if (!(*pde_ptr(fault_vaddr) & PG_P_1) || !(*pte & PG_P_1))
+    {
+        return demand_page_fault(cur, fault_vaddr);
+    }
+    if (!(*pte & PG_COW))
+    {
+        return false;
+    }
+
+    uint32_t pg_vaddr = fault_vaddr & 0xfffff000;
+    uint32_t old_phyaddr = *pte & 0xfffff000;
+    struct page *pg = phy2page(old_phyaddr);
+    if (pg->ref_cnt == 1)
+    {
+        // 共享者都已经复制走或者退出了,这一页独占,不用复制
+        *pte = (*pte & ~PG_COW) | PG_RW_W;
+        tlb_flush_page(pg_vaddr);
+        return true;
+    }
+
+    void *new_phyaddr = palloc(PF_USER);
+    if (new_phyaddr == NULL)
+    {
+        return false;
     }
-    bitmap_set(&mem_pool->pool_bitmap, bit_idx, 0); // 将位图中该位清0
+    // 旧页还映射在pg_vaddr,新页框临时映射到内核,直接复制
+    void *new_page = kmap((uint32_t)new_phyaddr);
+    memcpy(new_page, (void *)pg_vaddr, PG_SIZE);
+    kunmap(new_page);
+    *pte = (uint32_t)new_phyaddr | PG_US_U | PG_RW_W | PG_P_1;
+    tlb_flush_page(pg_vaddr);
+    pfree(old_phyaddr); // 去掉对旧页框的引用
+    return true;
 }
 
-/* 去掉页表中虚拟地址vaddr的映射,只去掉vaddr对应的pte */
-static void page_table_pte_remove(uint32_t vaddr)
+/*
+    Description:
+        从伙伴系统中取一个页框清0,放进所在zone的预清零页链表,由idle线程在空闲时调用
+    Return:
+        true: 清了一页
+        false: 各zone的预清零页都已经够了(或者没有空闲页框了)
+    Details:
+        - 哪个zone的预清零页少就先给哪个清,没有页框的zone不管
+        - 页框用kmap临时映射上来清0,低端内存的页框直接用直接映射区中的地址
+*/
+bool page_prezero(void)
 {
-    uint32_t *pte = pte_ptr(vaddr);
-    *pte &= ~PG_P_1; // 将页表项pte的P位置0
-    asm volatile("invlpg %0" ::"m"(vaddr)
-                 : "memory"); //更新tlb
+    struct zone *z = &zones[ZONE_NORMAL];
+    if (zones[ZONE_HIGH].managed_pages > 0 && zones[ZONE_HIGH].zeroed_cnt < z->zeroed_cnt)
+    {
+        z = &zones[ZONE_HIGH];
+    }
+    if (z->zeroed_cnt >= PREZERO_PAGES_MAX)
+    {
+        return false;
+    }
+    struct page *pg = buddy_alloc(z, 0);
+    if (pg == NULL)
+    {
+        return false;
+    }
+
+    void *page = kmap(page2phy(pg));
+    memset(page, 0, PG_SIZE);
+    kunmap(page);
+
+    enum intr_status old_status = intr_disable();
+    list_push(&z->zeroed_list, &pg->free_elem);
+    z->zeroed_cnt++;
+    intr_set_status(old_status);
+    return true;
 }
 
-/* 在虚拟地址池中释放以_vaddr起始的连续pg_cnt个虚拟页地址 */
-static void vaddr_remove(enum pool_flags pf, void *_vaddr, uint32_t pg_cnt)
+/* 在虚拟地址池中释放以_vaddr起始的连续pg_cnt个虚拟页地址,
+ * 用户地址要拆分vma但内存不足时返回false,此时地址空间没有被修改 */
+static bool vaddr_remove(enum pool_flags pf, void *_vaddr, uint32_t pg_cnt)
 {
-    uint32_t bit_idx_start = 0, vaddr = (uint32_t)_vaddr, cnt = 0;
+    uint32_t bit_idx_start = 0, vaddr = (uint32_t)_vaddr;
 
     if (pf == PF_KERNEL)
     { 
         // 内核虚拟内存池
         bit_idx_start = (vaddr - kernel_vaddr.vaddr_start) / PG_SIZE;
-        while (cnt < pg_cnt)
-        {
-            bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 0);
-        }
+        bitmap_set_range(&kernel_vaddr.vaddr_bitmap, bit_idx_start, pg_cnt, 0);
     }
     else
     { 
-        // 用户虚拟内存池
+        // 用户虚拟地址空间
         struct task_struct *cur_thread = running_thread();
-        bit_idx_start = (vaddr - cur_thread->userprog_vaddr.vaddr_start) / PG_SIZE;
-        while (cnt < pg_cnt)
-        {
-            bitmap_set(&cur_thread->userprog_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 0);
-        }
+        return vma_remove(&cur_thread->vmas, vaddr, vaddr + pg_cnt * PG_SIZE) == 0;
     }
+    return true;
 }
 
 /*
@@ -610,213 +1576,434 @@ static void vaddr_remove(enum pool_flags pf, void *_vaddr, uint32_t pg_cnt)
         pf: enum pool_flags 表明了用户内存池还是内核内存池
         _vaddr: void*。 要释放的虚拟地址
         pg_cnt: uint32_t。要释放的连续pg_cnt页
+    Return:
+        用户地址要拆分vma但内存不足时返回false,这时什么都不释放,页框仍然映射着
     Details:
-
+        直接映射区中的页只需把页框归还到内存池,其余的:
+        1. 清掉整段的页表项,把页框归还到内存池,并整段一起刷新TLB
+        2. 释放虚拟地址
+        用户地址先从vma中去掉再拆页表,否则拆分失败时这段地址还在vma中,
+        以后访问会按需映射新的页框,调用者却以为已经释放了
 */
-void mfree_page(enum pool_flags pf, void *_vaddr, uint32_t pg_cnt)
+bool mfree_page(enum pool_flags pf, void *_vaddr, uint32_t pg_cnt)
 {
-    uint32_t pg_phy_addr;
-    uint32_t vaddr = (int32_t)_vaddr, page_cnt = 0;
+    uint32_t vaddr = (int32_t)_vaddr;
     ASSERT(pg_cnt >= 1 && vaddr % PG_SIZE == 0);
-    pg_phy_addr = addr_v2p(vaddr); // 获取虚拟地址vaddr对应的物理地址
-
-    /* 确保待释放的物理内存在低端1M+1k大小的页目录+1k大小的页表地址范围外 */
-    ASSERT((pg_phy_addr % PG_SIZE) == 0 && pg_phy_addr >= 0x102000);
 
-    /* 判断pg_phy_addr属于用户物理内存池还是内核物理内存池 */
-    if (pg_phy_addr >= user_pool.phy_addr_start)
-    { 
-        // 位于user_pool内存池
-        vaddr -= PG_SIZE;
-        while (page_cnt < pg_cnt)
+    if (pf == PF_KERNEL && in_direct_map(vaddr))
+    {
+        // 直接映射区的页不占内核堆的虚拟地址,也不用改页表,把页框还给伙伴系统即可
+        uint32_t pg_phy_addr = kvaddr2phy(vaddr);
+        while (pg_cnt-- > 0)
         {
-            vaddr += PG_SIZE;
-            pg_phy_addr = addr_v2p(vaddr);
-
-            // 确保物理地址属于用户物理内存池
-            ASSERT((pg_phy_addr % PG_SIZE) == 0 && pg_phy_addr >= user_pool.phy_addr_start);
-
-            // 先将对应的物理页框归还到内存池
             pfree(pg_phy_addr);
-
-            // 取消虚拟地址和物理地址的联系 
-            // 清除虚拟地址对应的页表项pte的P位
-            page_table_pte_remove(vaddr);
-
-            page_cnt++;
+            pg_phy_addr += PG_SIZE;
         }
-        // 释放虚拟地址
-        vaddr_remove(pf, _vaddr, pg_cnt);
+        return true;
     }
-    else
-    { 
-        // 位于kernel_pool内存池
-        vaddr -= PG_SIZE;
-        while (page_cnt < pg_cnt)
-        {
-            vaddr += PG_SIZE;
-            pg_phy_addr = addr_v2p(vaddr);
-            ASSERT((pg_phy_addr % PG_SIZE) == 0 &&
-                   pg_phy_addr >= kernel_pool.phy_addr_start &&
-                   pg_phy_addr < user_pool.phy_addr_start);
-
-            // 释放物理地址
-            pfree(pg_phy_addr);
-
-            // 清除页表项的P位
-            page_table_pte_remove(vaddr);
 
-            page_cnt++;
+    if (pf == PF_USER)
+    {
+        if (!vaddr_remove(pf, _vaddr, pg_cnt))
+        {
+            return false;
         }
-        // 释放虚拟地址
-        vaddr_remove(pf, _vaddr, pg_cnt);
+        unmap_range(pf, vaddr, pg_cnt);
+        return true;
     }
+    unmap_range(pf, vaddr, pg_cnt); // 内核堆的地址要在页表拆掉之后才能给别人用
+    vaddr_remove(pf, _vaddr, pg_cnt);
+    return true;
 }
 
 /*
     Description:
-        回收地址为ptr的内存空间
+        回收kmalloc分配的地址为ptr的内存空间
     Parameters:
         ptr: void* 要回收的虚拟地址
     Details:
         要释放的地址ptr, 也就是当时申请空间时的mem_block起始地址
-        根据mem_block的起始地址，低12位取0，就得到该mem_block对应的arena地址
+        由block2arena从所在页的页框描述符找到该mem_block对应的arena地址
 
         然后根据arena的large和cnt属性，可以看出当时是大块分配(按页)，小块分配(按mem_block)
             - 如果是大块分配，就直接大块释放cnt个页
-            - 如果是小块分配，就要释放时，先把mem_block放回空闲列表
-                - 在放回去后，判断下该mem_block所在的arena中的内存块空闲个数
-                    如果都是空闲的，那么这1页就可以释放了
+            - 如果是小块分配，就要释放时，先把mem_block放回arena自己的空闲列表
+                - arena原来分完了，现在有了空闲块，重新挂回arena_list
+                - 在放回去后，如果arena中的内存块都空闲了，
+                    直接摘下并释放这个arena，不用再逐块从链表中找出来
 */
-void sys_free(void *ptr)
+void kfree(void *ptr)
 {
     ASSERT(ptr != NULL);
     if (ptr != NULL)
     {
-        enum pool_flags PF;
-        struct pool *mem_pool;
-
-        /* 判断是线程还是进程 */
-        if (running_thread()->pgdir == NULL)
-        {
-            ASSERT((uint32_t)ptr >= K_HEAP_START);
-            PF = PF_KERNEL;
-            mem_pool = &kernel_pool;
-        }
-        else
-        {
-            PF = PF_USER;
-            mem_pool = &user_pool;
-        }
+        struct pool *mem_pool = &kernel_pool;
+        ASSERT((uint32_t)ptr >= K_DIRECT_BASE);
 
         lock_acquire(&mem_pool->lock);
         struct mem_block *b = ptr;
         struct arena *a = block2arena(b); // 把mem_block转换成arena,获取元信息
-        ASSERT(a->large == 0 || a->large == 1);
-        if (a->desc == NULL && a->large == true)
-        { // 大于1024的内存
-            mfree_page(PF, a, a->cnt);
+        ASSERT(a != NULL);
+        if (a->large == true)
+        { // 大于最大内存块的内存
+            mem_pool->large_cnt--;
+            mem_pool->large_pages -= a->cnt;
+            mfree_page(PF_KERNEL, a, a->cnt);
         }
         else
-        { // 小于等于1024的内存块
-            /* 先将内存块回收到free_list */
-            list_append(&a->desc->free_list, &b->free_elem);
+        { // 不超过最大内存块的内存块
+            struct mem_block_desc *desc = a->desc;
+
+            /* 先将内存块回收到arena的free_list */
+            list_push(&a->free_list, &b->free_elem);
+            if (a->cnt++ == 0)
+            {
+                list_push(&desc->arena_list, &a->arena_elem);
+            }
 
             /* 再判断此arena中的内存块是否都是空闲,如果是就释放arena */
-            if (++a->cnt == a->desc->blocks_per_arena)
+            if (a->cnt == desc->blocks_per_arena)
             {
-                uint32_t block_idx;
-                for (block_idx = 0; block_idx < a->desc->blocks_per_arena; block_idx++)
-                {
-                    struct mem_block *b = arena2block(a, block_idx);
-                    ASSERT(elem_find(&a->desc->free_list, &b->free_elem));
-                    list_remove(&b->free_elem);
-                }
-                mfree_page(PF, a, 1);
+                list_remove(&a->arena_elem);
+                desc->arena_cnt--;
+                mfree_page(PF_KERNEL, a, desc->arena_pages);
             }
         }
         lock_release(&mem_pool->lock);
     }
 }
 
-/* 初始化内存池 */
+/* 把物理内存区z的统计信息填到info中,关中断读出,各项是同一时刻的 */
+static void zone_info_fill(struct zone *z, struct zone_info *info)
+{
+    uint8_t order;
+    enum intr_status old_status = intr_disable();
+    info->phy_addr_start = z->start_pfn * PG_SIZE;
+    info->phy_addr_end = z->end_pfn * PG_SIZE;
+    info->total_pages = z->managed_pages;
+    info->zeroed_pages = z->zeroed_cnt;
+    info->free_pages = z->free_pages + z->zeroed_cnt;
+    info->watermark = z->watermark;
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++)
+    {
+        info->nr_free[order] = z->free_area[order].nr_free;
+    }
+    intr_set_status(old_status);
+}
+
+/* 把内存使用者m_pool的统计信息填到info中 */
+static void pool_info_fill(struct pool *m_pool, struct pool_info *info)
+{
+    lock_acquire(&m_pool->lock);
+    info->total_pages = m_pool->total_pages;
+    info->used_pages = m_pool->used_pages;
+    info->peak_pages = m_pool->peak_pages;
+    info->large_cnt = m_pool->large_cnt;
+    info->large_pages = m_pool->large_pages;
+    lock_release(&m_pool->lock);
+}
+
+/* 把内存块描述符表descs的统计信息填到info中,空闲块数要遍历还有空闲块的arena */
+static void block_desc_info_fill(struct pool *m_pool, struct mem_block_desc *descs, struct block_desc_info *info)
+{
+    uint8_t desc_idx;
+    lock_acquire(&m_pool->lock);
+    for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++)
+    {
+        struct mem_block_desc *desc = &descs[desc_idx];
+        info[desc_idx].block_size = desc->block_size;
+        info[desc_idx].arena_pages = desc->arena_pages;
+        info[desc_idx].arena_cnt = desc->arena_cnt;
+        info[desc_idx].free_blocks = 0;
+        struct list_elem *elem = desc->arena_list.head.next;
+        while (elem != &desc->arena_list.tail)
+        {
+            struct arena *a = elem2entry(struct arena, arena_elem, elem);
+            info[desc_idx].free_blocks += a->cnt;
+            elem = elem->next;
+        }
+    }
+    lock_release(&m_pool->lock);
+}
+
+/* vma_traversal的回调函数,把vma的大小累加到arg指向的meminfo中 */
+static bool vma_info_add(struct vma *vma, int arg)
+{
+    struct meminfo *info = (struct meminfo *)arg;
+    uint32_t pg_cnt = (vma->end - vma->start) / PG_SIZE;
+    info->vaddr_pages += pg_cnt;
+    if (vma->flags & VM_SHARED)
+    {
+        info->shared_pages += pg_cnt;
+    }
+    if (vma->flags & VM_HEAP)
+    {
+        info->heap_pages += pg_cnt;
+    }
+    return false;
+}
+
+/*
+    Description:
+        生成当前内存使用情况的快照
+    Parameters:
+        info: struct meminfo* 快照写到这里,用户进程传入的是自己的地址
+    Details:
+        包括两个物理内存区、内核和用户进程两个使用者的用量、内核堆的虚拟地址、
+        内核的内存块描述符以及调用者进程的brk堆和vma。
+        各部分分别在对应的锁内或关中断读出,彼此之间不保证是同一时刻的
+*/
+void sys_meminfo(struct meminfo *info)
+{
+    struct task_struct *cur = running_thread();
+    memset(info, 0, sizeof(struct meminfo));
+    zone_info_fill(&zones[ZONE_NORMAL], &info->normal);
+    zone_info_fill(&zones[ZONE_HIGH], &info->high);
+    pool_info_fill(&kernel_pool, &info->kernel);
+    pool_info_fill(&user_pool, &info->user);
+
+    lock_acquire(&kernel_pool.lock);
+    info->kvaddr_pages = kernel_vaddr.vaddr_bitmap.btmp_bytes_len * 8;
+    info->kvaddr_used = bitmap_count(&kernel_vaddr.vaddr_bitmap);
+    lock_release(&kernel_pool.lock);
+
+    block_desc_info_fill(&kernel_pool, k_block_descs, info->k_descs);
+    if (cur->pgdir != NULL)
+    {
+        info->brk = cur->brk;
+        info->vma_cnt = cur->vmas.vma_cnt;
+        vma_traversal(&cur->vmas, vma_info_add, (int)info);
+    }
+}
+
+/*
+    Description:
+        根据loader收集的ARDS整理出可用物理内存段mem_regions
+    Parameters:
+        used_mem: uint32_t 低于此地址的物理内存已被内核、页目录和页表占用
+        all_mem: uint32_t loader算出的内存容量,BIOS不支持0xe820时使用
+    Details:
+        - 只要type为1的内存,4G以上的部分32位分页用不了,直接丢弃
+        - 每段都按页对齐,起始地址向上取整,结束地址向下取整
+        - 按起始地址插入排序,和前一段重叠的部分截掉
+*/
+static void mem_regions_init(uint32_t used_mem, uint32_t all_mem)
+{
+    struct ards *ards = (struct ards *)ARDS_BUF_ADDR;
+    uint16_t ards_nr = *(uint16_t *)ARDS_NR_ADDR, ards_idx;
+    if (ards_nr > ARDS_MAX)
+    {
+        ards_nr = ARDS_MAX;
+    }
+    mem_region_cnt = 0;
+    for (ards_idx = 0; ards_idx < ards_nr; ards_idx++, ards++)
+    {
+        if (ards->type != ARDS_TYPE_USABLE || ards->base_high != 0)
+        {
+            continue;
+        }
+        uint32_t start = ards->base_low, end = ards->base_low + ards->length_low;
+        if (ards->length_high != 0 || end < start)
+        { // 超过4G的部分截掉
+            end = 0xfffff000;
+        }
+        if (start < used_mem)
+        {
+            start = used_mem;
+        }
+        start = (start + PG_SIZE - 1) & 0xfffff000;
+        end &= 0xfffff000;
+        if (start >= end)
+        {
+            continue;
+        }
+
+        // 插入排序
+        uint32_t pos = mem_region_cnt;
+        while (pos > 0 && mem_regions[pos - 1].start > start)
+        {
+            mem_regions[pos] = mem_regions[pos - 1];
+            pos--;
+        }
+        mem_regions[pos].start = start;
+        mem_regions[pos].end = end;
+        mem_region_cnt++;
+    }
+
+    // 去掉重叠的部分
+    uint32_t idx = 1;
+    while (idx < mem_region_cnt)
+    {
+        if (mem_regions[idx].start < mem_regions[idx - 1].end)
+        {
+            mem_regions[idx].start = mem_regions[idx - 1].end;
+        }
+        if (mem_regions[idx].start >= mem_regions[idx].end)
+        {
+            memcpy(&mem_regions[idx], &mem_regions[idx + 1], (mem_region_cnt - idx - 1) * sizeof(struct mem_region));
+            mem_region_cnt--;
+            continue;
+        }
+        idx++;
+    }
+
+    if (mem_region_cnt == 0)
+    { // BIOS不支持0xe820,只知道内存容量,把used_mem以上的内存都当作可用
+        mem_regions[0].start = used_mem;
+        mem_regions[0].end = all_mem & 0xfffff000;
+        mem_region_cnt = 1;
+    }
+}
+
+/* 返回第pg_nr个可用物理页框(从0数起,跳过空洞)的物理地址 */
+static uint32_t usable_page_phyaddr(uint32_t pg_nr)
+{
+    uint32_t idx;
+    for (idx = 0; idx < mem_region_cnt; idx++)
+    {
+        uint32_t region_pages = (mem_regions[idx].end - mem_regions[idx].start) / PG_SIZE;
+        if (pg_nr < region_pages)
+        {
+            return mem_regions[idx].start + pg_nr * PG_SIZE;
+        }
+        pg_nr -= region_pages;
+    }
+    // 正好是最后一页之后
+    return mem_regions[mem_region_cnt - 1].end;
+}
+
+/* 返回物理地址phy_addr以下的可用页数 */
+static uint32_t usable_pages_below(uint32_t phy_addr)
+{
+    uint32_t idx, pg_cnt = 0;
+    for (idx = 0; idx < mem_region_cnt && mem_regions[idx].start < phy_addr; idx++)
+    {
+        uint32_t end = mem_regions[idx].end < phy_addr ? mem_regions[idx].end : phy_addr;
+        pg_cnt += (end - mem_regions[idx].start) / PG_SIZE;
+    }
+    return pg_cnt;
+}
+
+/* 初始化物理内存区和内存使用者 */
 static void mem_pool_init(uint32_t all_mem)
 {
     put_str("   mem_pool_init start\n");
-    /* 0. 根据计算机中剩余的物理内存，分成两部分，内核物理内存池和用户物理内存池 */
-    uint32_t page_table_size = PG_SIZE * 256;       // 页表大小= 1页的页目录表+第0和第768个页目录项指向同一个页表+
+    uint32_t page_table_size = PG_SIZE * 256;       // 页表大小= 1页的页目录表+第0和第768个页目录项共用的页表(映射物理地址0~4M)+
                                                     // 第769~1022个页目录项共指向254个页表,共256个页框
     uint32_t used_mem = page_table_size + 0x100000; // 0x100000为低端1M内存, 结果为0x200000
-    uint32_t free_mem = all_mem - used_mem;
-    uint16_t all_free_pages = free_mem / PG_SIZE; // 1页为4k,不管总内存是不是4k的倍数,
-                                                  // 对于以页为单位的内存分配策略，不足1页的内存不用考虑了。
-    uint16_t kernel_free_pages = all_free_pages / 2;
-    uint16_t user_free_pages = all_free_pages - kernel_free_pages;
-
-    uint32_t kbm_length = kernel_free_pages / 8; // Kernel BitMap的长度,位图中的一位表示一页,以字节为单位
-    uint32_t ubm_length = user_free_pages / 8;   // User BitMap的长度.
-
-    uint32_t kp_start = used_mem;                               // Kernel Pool start,内核内存池的起始地址
-    uint32_t up_start = kp_start + kernel_free_pages * PG_SIZE; // User Pool start,用户内存池的起始地址
-
-    /*************************** 1. 设置物理内存池的起始物理地址 phy_addr_start *************************/
-        // 1.1 内核物理内存池的起始地址
-    kernel_pool.phy_addr_start = kp_start;
-        // 1.2 用户物理内存池的起始地址
-    user_pool.phy_addr_start = up_start;
-
-    /************************** 2. 设置物理内存池的尺寸 pool_size  *********************************/
-        // 2.1 内核物理内存池的大小
-    kernel_pool.pool_size = kernel_free_pages * PG_SIZE;
-        // 2.2 用户物理内存池的大小
-    user_pool.pool_size = user_free_pages * PG_SIZE;
-
-    /************************** 3. 设置物理内存池的位图长度 pool_bitmap.btmp_bytes_len **************/
-        // 3.1 内核物理内存池的位图长度
-    kernel_pool.pool_bitmap.btmp_bytes_len = kbm_length;
-        // 3.2 用户物理内存池的位图长度
-    user_pool.pool_bitmap.btmp_bytes_len = ubm_length;
-
-    /************************** 4. 设置物理内存池的位图空间 pool_bitmap.bits  **********************/
-    	// 4.1 设置内核物理内存池的位图空间
-        // 内核使用的最高地址是0xc009f000,这是主线程的栈地址.(内核的大小预计为70K左右)
-        // 32M内存占用的位图是2k.内核内存池的位图先定在MEM_BITMAP_BASE(0xc009a000)处.
-    kernel_pool.pool_bitmap.bits = (void *)MEM_BITMAP_BASE; // MEM_BITMAP_BASE = 0xc009a000(虚拟地址)
-                                                            // // 0xc009a000会指向物理地址的0x9a000（因为页表是这样映射的）
-
-
-        // 4.2 设置用户物理内存池的位图空间
-    	/* 用户内存池的位图紧跟在内核内存池位图之后 */
-    user_pool.pool_bitmap.bits = (void *)(MEM_BITMAP_BASE + kbm_length);
-    /******************** 输出内存池信息 **********************/
-    put_str("      kernel_pool_bitmap_start:");
-    put_int((int)kernel_pool.pool_bitmap.bits);
-    put_str(" kernel_pool_phy_addr_start:");
-    put_int(kernel_pool.phy_addr_start);
-    put_str("\n");
-    put_str("      user_pool_bitmap_start:");
-    put_int((int)user_pool.pool_bitmap.bits);
-    put_str(" user_pool_phy_addr_start:");
-    put_int(user_pool.phy_addr_start);
-    put_str("\n");
 
-        // 4.3 把位图的空间置0
-    bitmap_init(&kernel_pool.pool_bitmap);
-    bitmap_init(&user_pool.pool_bitmap);
+    /* 0. 根据ARDS找出可用的物理内存段 */
+    mem_regions_init(used_mem, all_mem);
+    uint32_t idx;
+    uint32_t span_end = mem_regions[mem_region_cnt - 1].end;
+
+    /* 1. 划分低端内存和高端内存
+     *    K_DIRECT_MAX_PHY以下是低端内存,全部放进直接映射区,以上是高端内存。
+     *    K_DIRECT_MAX_PHY按4M对齐,两个区的伙伴块不会跨区 */
+    uint32_t normal_end = span_end < K_DIRECT_MAX_PHY ? span_end : K_DIRECT_MAX_PHY;
+
+    /*************************** 2. 建立直接映射区 ***************************************/
+        // 物理地址0到低端内存末尾用4M大页映射到K_DIRECT_BASE起,第768个页目录项已由loader映射好。
+        // 原来769以后的页目录项指向loader建的空页表,直接改成大页即可,这些页表就不再用了。
+        // 直接映射区在所有进程的页目录中都一样,设为全局页
+    uint32_t big_page_phyaddr;
+    k_direct_end = K_DIRECT_BASE + DIV_ROUND_UP(normal_end, BIG_PAGE_SIZE) * BIG_PAGE_SIZE;
+    for (big_page_phyaddr = BIG_PAGE_SIZE; K_DIRECT_BASE + big_page_phyaddr < k_direct_end; big_page_phyaddr += BIG_PAGE_SIZE)
+    {
+        *pde_ptr(K_DIRECT_BASE + big_page_phyaddr) = big_page_phyaddr | PG_PS | PG_G | PG_US_S | PG_RW_W | PG_P_1;
+    }
+
+    /* 3. 计算元数据的大小:覆盖物理地址0到最后一段可用内存(包括空洞)的页框描述符数组 + 内核堆虚拟地址的位图
+     *    元数据占用可用内存最前面的页框,剩下的全部交给两个zone的伙伴系统。
+     *    内核堆紧跟在直接映射区和元数据之后,最多和低端内存一样大 */
+    page_desc_cnt = span_end / PG_SIZE;
+    uint32_t page_desc_pages = DIV_ROUND_UP(page_desc_cnt * sizeof(struct page), PG_SIZE);
+    uint32_t kheap_pages = usable_pages_below(normal_end);
+    if (kheap_pages > (K_HEAP_VADDR_END - k_direct_end) / PG_SIZE - page_desc_pages)
+    {
+        kheap_pages = (K_HEAP_VADDR_END - k_direct_end) / PG_SIZE - page_desc_pages;
+    }
+    uint32_t kbm_length = DIV_ROUND_UP(kheap_pages, 8); // Kernel BitMap的长度,位图中的一位表示一页,以字节为单位
+    uint32_t kbm_pages = DIV_ROUND_UP(kbm_length, PG_SIZE);
+    uint32_t meta_pages = page_desc_pages + kbm_pages;
+    if (kheap_pages > (K_HEAP_VADDR_END - k_direct_end) / PG_SIZE - meta_pages)
+    { // 位图本身也占了内核堆的虚拟地址,多出来的几位不会用到
+        kheap_pages = (K_HEAP_VADDR_END - k_direct_end) / PG_SIZE - meta_pages;
+    }
+    uint32_t usable_start = usable_page_phyaddr(meta_pages); // 元数据之后第一个可分配的物理地址
+
+    /*************************** 4. 映射元数据 ***************************************/
+        // 元数据的物理页是可用内存最前面的meta_pages页,不一定物理连续,映射到直接映射区之后的内核堆起始处,
+        // 内核页表在loader中已经建好,这里直接填页表项即可
+    uint32_t meta_vaddr = k_direct_end;
+    for (idx = 0; idx < meta_pages; idx++)
+    {
+        *pte_ptr(meta_vaddr) = usable_page_phyaddr(idx) | PG_US_S | PG_RW_W | PG_P_1;
+        meta_vaddr += PG_SIZE;
+    }
+
+    /*************************** 5. 初始化页框描述符 *************************/
+        // 先全部标记为不可用,zone_init再把可用的部分交给伙伴系统。
+        // 高端内存的页框打上PG_HIGHMEM,释放时据此找到所在的zone,不用再比较物理地址
+    page_descs = (struct page *)k_direct_end;
+    memset(page_descs, 0, page_desc_cnt * sizeof(struct page));
+    for (idx = 0; idx < page_desc_cnt; idx++)
+    {
+        page_descs[idx].flags = PG_RESERVED;
+        page_descs[idx].ref_cnt = 1;
+        if (idx >= normal_end / PG_SIZE)
+        {
+            page_descs[idx].flags |= PG_HIGHMEM;
+        }
+    }
 
-        // 4.4 初始化锁
+    /************************** 6. 初始化两个zone的伙伴系统 **********************************************/
+    zone_init(&zones[ZONE_NORMAL], 0, normal_end / PG_SIZE, usable_start);
+    zone_init(&zones[ZONE_HIGH], normal_end / PG_SIZE, page_desc_cnt, usable_start);
+        // 低端内存留出一部分给内核,用户进程先用高端内存,用低端内存时不能越过水位线
+    zones[ZONE_NORMAL].watermark = zones[ZONE_NORMAL].managed_pages / NORMAL_WATERMARK_RATIO;
+
+    /************************** 7. 初始化内存使用者 **********************************************/
+        // 内核和用户进程不再各占一半内存,只分别记账;内核最多用完低端内存,用户进程用不到低端内存水位线以下的部分
+    memset(&kernel_pool, 0, sizeof(kernel_pool));
+    memset(&user_pool, 0, sizeof(user_pool));
+    kernel_pool.total_pages = zones[ZONE_NORMAL].managed_pages;
+    user_pool.total_pages = zones[ZONE_NORMAL].managed_pages - zones[ZONE_NORMAL].watermark + zones[ZONE_HIGH].managed_pages;
     lock_init(&kernel_pool.lock);
     lock_init(&user_pool.lock);
 
-    /************************** 5. 设置内核虚拟地址池 kernel_vaddr ***************************/
-    	// 5.1 设置内核虚拟地址池 的 起始虚拟地址 vaddr_start，高端虚拟内存1G是内核空间
-    kernel_vaddr.vaddr_start = K_HEAP_START;
-        // 5.2 设置内核虚拟地址池的长度  vaddr_bitmap.btmp_bytes_len
-         /* 下面初始化内核虚拟地址的位图,按实际物理内存大小生成数组。*/
-    kernel_vaddr.vaddr_bitmap.btmp_bytes_len = kbm_length; // 用于维护内核堆的虚拟地址,所以要和内核内存池大小一致
+    /******************** 输出内存信息 **********************/
+    put_str("      mem_regions:");
+    for (idx = 0; idx < mem_region_cnt; idx++)
+    {
+        put_str(" ");
+        put_int(mem_regions[idx].start);
+        put_str("-");
+        put_int(mem_regions[idx].end);
+    }
+    put_str("\n");
+    put_str("      page_descs:");
+    put_int((int)page_descs);
+    put_str(" direct_map_end:");
+    put_int(k_direct_end);
+    put_str("\n");
+    put_str("      normal_pages:");
+    put_int(zones[ZONE_NORMAL].managed_pages);
+    put_str(" high_pages:");
+    put_int(zones[ZONE_HIGH].managed_pages);
+    put_str(" normal_watermark:");
+    put_int(zones[ZONE_NORMAL].watermark);
+    put_str("\n");
+
+    /************************** 8. 设置内核虚拟地址池 kernel_vaddr ***************************/
+    	// 8.1 设置内核虚拟地址池 的 起始虚拟地址 vaddr_start，高端虚拟内存1G是内核空间
+        // 内核堆在直接映射区之后,最前面已经被元数据占用,要跨过去
+    kernel_vaddr.vaddr_start = k_direct_end + meta_pages * PG_SIZE;
+        // 8.2 设置内核虚拟地址池的长度  vaddr_bitmap.btmp_bytes_len
+    kernel_vaddr.vaddr_bitmap.btmp_bytes_len = kbm_length;
 
-        // 5.4 初始化内核虚拟地址池的位图空间 -> 置为0
-    kernel_vaddr.vaddr_bitmap.bits = (void *)(MEM_BITMAP_BASE + kbm_length + ubm_length);
+        // 8.3 内核虚拟地址池的位图紧跟在页框描述符数组后面,初始化为0
+    kernel_vaddr.vaddr_bitmap.bits = (void *)(k_direct_end + page_desc_pages * PG_SIZE);
 
     
     bitmap_init(&kernel_vaddr.vaddr_bitmap);
@@ -828,52 +2015,70 @@ static void mem_pool_init(uint32_t all_mem)
         构建出DESC_CNT种规格的内存块描述符
     Details:
         主要是设置mem_block_desc的几个成员
+        - 相邻规格相差不超过一半,比按2的幂分级浪费少
+        - arena从1页起,块切完剩下的空间超过1/8就把arena翻倍,最大ARENA_MAX_PAGES页
     Parameters:
-        desc_array: 需要进行初始化的内存块描述符表（包含7个内存块描述符）
+        desc_array: 需要进行初始化的内存块描述符表（包含DESC_CNT个内存块描述符）
 */
-void block_desc_init(struct mem_block_desc *desc_array)
+static void block_desc_init(struct mem_block_desc *desc_array)
 {
-    uint16_t desc_idx, block_size = 16;
+    static const uint16_t block_sizes[DESC_CNT] = {16, 32, 48, 64, 96, 128, 192, 256, 384,
+                                                   512, 768, 1024, 1344, 2048, 3072, 4096, 8192, 16384};
+    uint16_t desc_idx;
 
     /* 初始化每个mem_block_desc描述符 */
     for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++)
     {
+        uint32_t block_size = block_sizes[desc_idx], arena_pages = 1, blocks;
+        while (1)
+        {
+            uint32_t arena_size = arena_pages * PG_SIZE;
+            blocks = (arena_size - sizeof(struct arena)) / block_size;
+            if (arena_pages == ARENA_MAX_PAGES || arena_size - blocks * block_size <= arena_size / 8)
+            {
+                break;
+            }
+            arena_pages *= 2;
+        }
         desc_array[desc_idx].block_size = block_size;
 
         /* 初始化arena中的内存块数量 */
-        desc_array[desc_idx].blocks_per_arena = (PG_SIZE - sizeof(struct arena)) / block_size;
-
-        list_init(&desc_array[desc_idx].free_list);
+        desc_array[desc_idx].blocks_per_arena = blocks;
+        desc_array[desc_idx].arena_pages = arena_pages;
+        desc_array[desc_idx].arena_cnt = 0;
 
-        block_size *= 2; // 更新为下一个规格内存块
+        list_init(&desc_array[desc_idx].arena_list);
     }
 }
 
-/* 根据物理页框地址pg_phy_addr在相应的内存池的位图清0,不改动页表*/
+/* 根据物理页框地址pg_phy_addr把页框还给相应内存池的伙伴系统,不改动页表*/
 void free_a_phy_page(uint32_t pg_phy_addr)
 {
-    struct pool *mem_pool;
-    uint32_t bit_idx = 0;
-    if (pg_phy_addr >= user_pool.phy_addr_start)
-    {
-        mem_pool = &user_pool;
-        bit_idx = (pg_phy_addr - user_pool.phy_addr_start) / PG_SIZE;
-    }
-    else
-    {
-        mem_pool = &kernel_pool;
-        bit_idx = (pg_phy_addr - kernel_pool.phy_addr_start) / PG_SIZE;
-    }
-    bitmap_set(&mem_pool->pool_bitmap, bit_idx, 0);
+    pfree(pg_phy_addr);
 }
 
 /* 内存管理部分初始化入口 */
 void mem_init()
 {
     put_str("mem_init start\n");
-    uint32_t mem_bytes_total = (*(uint32_t *)(0xb00));
+    uint32_t mem_bytes_total = (*(uint32_t *)(TOTAL_MEM_BYTES_ADDR));
     mem_pool_init(mem_bytes_total); // 初始化内存池
                                     /* 初始化mem_block_desc数组descs,为malloc做准备 */
     block_desc_init(k_block_descs);
+
+    /* 临时映射窗口的槽位全部空闲 */
+    kmap_bitmap.btmp_bytes_len = sizeof(kmap_bits);
+    kmap_bitmap.bits = kmap_bits;
+    bitmap_init(&kmap_bitmap);
+
+    /* vma结点的缓存 */
+    vma_init();
+
+    /* 打开cr0的WP位(第16位),让内核写只读的用户页时也触发缺页,
+     * 这样内核代用户进程写共享页(如read系统调用)时同样会走写时复制 */
+    uint32_t cr0;
+    asm volatile("movl %%cr0, %0" : "=r"(cr0));
+    cr0 |= 0x00010000;
+    asm volatile("movl %0, %%cr0" ::"r"(cr0) : "memory");
     put_str("mem_init done\n");
 }
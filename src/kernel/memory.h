@@ -16,6 +16,18 @@ enum pool_flags {
 #define	 PG_RW_W  2	// R/W 属性位值, 读/写/执行
 #define	 PG_US_S  0	// U/S 属性位值, 系统级
 #define	 PG_US_U  4	// U/S 属性位值, 用户级
+#define	 PG_PS	  0x80	// 页目录项的PS位, 为1时直接映射4M大页
+#define	 PG_G	  0x100	// 全局页, 切换cr3时不从TLB中清除
+#define	 PG_COW	  0x200	// 页表项中留给软件用的第9位, 标记写时复制的共享页
+
+/* 内核内存池所在的低端物理内存线性映射到K_DIRECT_BASE起的直接映射区,
+ * 直接映射区中虚拟地址和物理地址只差一个偏移 */
+#define K_DIRECT_BASE 0xc0000000
+#define kvaddr2phy(vaddr) ((uint32_t)(vaddr) - K_DIRECT_BASE)
+#define phy2kvaddr(phy_addr) ((void*)((uint32_t)(phy_addr) + K_DIRECT_BASE))
+
+/* 用户态malloc_flags的flags */
+#define MF_NOZERO 1	// 不清0,调用者马上会完整地写一遍
 
 /* 用于虚拟地址管理 */
 struct virtual_addr {
@@ -30,14 +42,61 @@ struct mem_block {
    struct list_elem free_elem;
 };
 
-/* 内存块描述符 */
+/* 内存块描述符,内核的堆有一组 */
 struct mem_block_desc {
-   uint32_t block_size;		 // 内存块大小
-   uint32_t blocks_per_arena;	 // 本arena中可容纳此mem_block的数量.
-   struct list free_list;	 // 目前可用的mem_block链表
+   uint16_t block_size;		 // 内存块大小
+   uint8_t blocks_per_arena;	 // 本arena中可容纳此mem_block的数量.
+   uint8_t arena_pages;		 // 一个arena占的页数,是2的幂
+   uint32_t arena_cnt;		 // 现有的arena个数,包括块已分完的
+   struct list arena_list;	 // 还有空闲mem_block的arena链表
+};
+
+#define DESC_CNT 18
+
+/* 伙伴系统的最大阶,最大的空闲块是2^BUDDY_MAX_ORDER个页框,即4M */
+#define BUDDY_MAX_ORDER 10
+
+/* 物理内存区(zone)的统计信息 */
+struct zone_info {
+   uint32_t phy_addr_start;		 // 本区的物理地址范围[start, end)
+   uint32_t phy_addr_end;
+   uint32_t total_pages;		 // 可用页框数
+   uint32_t free_pages;			 // 空闲页框数,包括预先清0的
+   uint32_t zeroed_pages;		 // idle线程预先清0的页框数
+   uint32_t watermark;			 // 空闲页框降到这里后不再给用户进程,留给内核
+   uint32_t nr_free[BUDDY_MAX_ORDER + 1]; // 伙伴系统各阶的空闲块数,可以看出碎片程度
 };
 
-#define DESC_CNT 7
+/* 内存使用者(内核或用户进程)的统计信息 */
+struct pool_info {
+   uint32_t total_pages;		 // 能分到的页框上限
+   uint32_t used_pages;			 // 占用的页框数,内核的包括进程的页表
+   uint32_t peak_pages;			 // 占用页框数的最高值
+   uint32_t large_cnt;			 // kmalloc按页分配出去的大块内存个数
+   uint32_t large_pages;		 // 这些大块内存占的页数
+};
+
+/* 一种规格内存块的统计信息 */
+struct block_desc_info {
+   uint32_t block_size;			 // 内存块大小
+   uint32_t arena_pages;		 // 一个arena占的页数
+   uint32_t arena_cnt;			 // 现有的arena个数
+   uint32_t free_blocks;		 // 现有arena中的空闲块数
+};
+
+/* sys_meminfo返回的内存使用情况快照 */
+struct meminfo {
+   struct zone_info normal, high;	 // 低端内存和高端内存,内核只用低端内存
+   struct pool_info kernel, user;	 // 内核和用户进程的用量
+   uint32_t kvaddr_pages;		 // 内核堆的虚拟页数
+   uint32_t kvaddr_used;		 // 内核堆已占用的虚拟页数
+   uint32_t vma_cnt;			 // 调用者进程的vma个数
+   uint32_t vaddr_pages;		 // 调用者进程预留的虚拟页数,包括共享内存段
+   uint32_t shared_pages;		 // 其中连接的共享内存段的页数
+   uint32_t heap_pages;			 // 其中brk堆预留的页数
+   uint32_t brk;			 // 调用者进程的program break,内核线程调用时为0
+   struct block_desc_info k_descs[DESC_CNT]; // 内核的内存块
+};
 
 extern struct pool kernel_pool, user_pool;
 void mem_init(void);
@@ -47,13 +106,25 @@ void malloc_init(void);
 uint32_t* pte_ptr(uint32_t vaddr);
 uint32_t* pde_ptr(uint32_t vaddr);
 uint32_t addr_v2p(uint32_t vaddr);
-void* get_a_page(enum pool_flags pf, uint32_t vaddr);
 void* get_user_pages(uint32_t pg_cnt);
-void block_desc_init(struct mem_block_desc* desc_array);
-void* sys_malloc(uint32_t size);
-void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt);
+uint32_t sys_brk(uint32_t new_brk);
+bool mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt);
 void pfree(uint32_t pg_phy_addr);
-void sys_free(void* ptr);
-void* get_a_page_without_opvaddrbitmap(enum pool_flags pf, uint32_t vaddr);
+void* kmalloc(uint32_t size);
+void kfree(void* ptr);
 void free_a_phy_page(uint32_t pg_phy_addr);
+void user_frames_release(uint32_t start, uint32_t end);
+void user_page_tables_release(void);
+void page_ref_inc(uint32_t pg_phy_addr);
+void cow_share_undo(uint32_t vaddr);
+void page_table_add_pte(void* vaddr, uint32_t pte_val);
+bool map_range(uint32_t vaddr, const uint32_t* pte_vals, uint32_t pg_cnt);
+void unmap_range(enum pool_flags pf, uint32_t vaddr, uint32_t pg_cnt);
+bool pgdir_map_range(uint32_t* pgdir, uint32_t vaddr, const uint32_t* pte_vals, uint32_t pg_cnt);
+void* kmap(uint32_t pg_phy_addr);
+void kunmap(void* vaddr);
+uint32_t user_page_alloc_zeroed(uint32_t pg_vaddr);
+bool page_fault_fixup(uint32_t fault_vaddr);
+bool page_prezero(void);
+void sys_meminfo(struct meminfo* info);
 #endif
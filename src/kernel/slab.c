@@ -0,0 +1,119 @@
+#include "slab.h"
+#include "global.h"
+#include "debug.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "string.h"
+
+/*
+    Description:
+        初始化对象缓存cache
+    Parameters:
+        obj_size: uint32_t 对象大小,最大一页
+        elem_offset: uint32_t 空闲时存放链表结点的位置,须避开构造函数初始化好、之后也不会变的部分
+        ctor: kmem_ctor* 构造函数,可以为NULL
+        free_max: uint32_t 整页对象最多保留的空闲个数
+*/
+void kmem_cache_init(struct kmem_cache *cache, const char *name, uint32_t obj_size,
+                     uint32_t elem_offset, kmem_ctor *ctor, uint32_t free_max)
+{
+    ASSERT(obj_size >= sizeof(struct list_elem) && obj_size <= PG_SIZE);
+    ASSERT(elem_offset + sizeof(struct list_elem) <= obj_size);
+    cache->name = name;
+    cache->obj_size = obj_size;
+    cache->elem_offset = elem_offset;
+    cache->ctor = ctor;
+    cache->free_max = free_max;
+    cache->free_cnt = 0;
+    cache->total_cnt = 0;
+    list_init(&cache->free_list);
+}
+
+/* 对象obj中存放链表结点的位置 */
+static struct list_elem *obj2elem(struct kmem_cache *cache, void *obj)
+{
+    return (struct list_elem *)((uint32_t)obj + cache->elem_offset);
+}
+
+/*
+    Description:
+        申请一页,切成对象并逐个构造,放进空闲链表
+    Return:
+        内存不足时返回false
+*/
+static bool kmem_cache_grow(struct kmem_cache *cache)
+{
+    uint32_t page = (uint32_t)get_kernel_pages(1);
+    if (page == 0)
+    {
+        return false;
+    }
+    uint32_t obj_cnt = PG_SIZE / cache->obj_size;
+    uint32_t idx;
+    for (idx = 0; idx < obj_cnt; idx++)
+    {
+        void *obj = (void *)(page + idx * cache->obj_size);
+        if (cache->ctor != NULL)
+        {
+            cache->ctor(obj);
+        }
+        enum intr_status old_status = intr_disable();
+        list_push(&cache->free_list, obj2elem(cache, obj));
+        cache->free_cnt++;
+        cache->total_cnt++;
+        intr_set_status(old_status);
+    }
+    return true;
+}
+
+/*
+    Description:
+        从缓存cache中取一个已构造好的对象
+    Return:
+        对象地址,内存不足时返回NULL
+    Details:
+        有空闲对象时只是一次出链,不用分配页框、改页表和清0;
+        空闲链表空了才从内核内存池申请一页来切
+*/
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+    enum intr_status old_status = intr_disable();
+    while (list_empty(&cache->free_list))
+    {
+        intr_set_status(old_status);
+        if (!kmem_cache_grow(cache))
+        {
+            return NULL;
+        }
+        old_status = intr_disable();
+    }
+    struct list_elem *elem = list_pop(&cache->free_list);
+    cache->free_cnt--;
+    intr_set_status(old_status);
+
+    memset(elem, 0, sizeof(struct list_elem));
+    return (void *)((uint32_t)elem - cache->elem_offset);
+}
+
+/*
+    Description:
+        把对象obj还给缓存cache
+    Details:
+        调用者须保证对象已恢复到构造好的状态,下次分配出去时不再构造。
+        整页对象的空闲个数超过free_max时直接把页还给内存池
+*/
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    enum intr_status old_status = intr_disable();
+    if (cache->obj_size == PG_SIZE && cache->free_cnt >= cache->free_max)
+    {
+        cache->total_cnt--;
+        mfree_page(PF_KERNEL, obj, 1);
+    }
+    else
+    {
+        list_push(&cache->free_list, obj2elem(cache, obj));
+        cache->free_cnt++;
+    }
+    intr_set_status(old_status);
+}
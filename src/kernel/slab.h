@@ -0,0 +1,25 @@
+#ifndef __KERNEL_SLAB_H
+#define __KERNEL_SLAB_H
+#include "stdint.h"
+#include "list.h"
+
+/* 对象的构造函数,对象第一次从页中切出来时调用一次,回收再分配时不再调用 */
+typedef void(kmem_ctor)(void* obj);
+
+/* 固定大小内核对象的缓存 */
+struct kmem_cache {
+   const char* name;
+   uint32_t obj_size;	 // 对象大小,不小于一个list_elem
+   uint32_t elem_offset; // 空闲对象在此偏移处存放free_list的结点,分配出去时这8个字节清0
+   kmem_ctor* ctor;	 // 为NULL时不构造
+   uint32_t free_max;	 // 整页对象最多缓存的空闲个数,多出的还给内存池;小对象所在的页不归还
+   uint32_t free_cnt;	 // free_list中的对象个数
+   uint32_t total_cnt;	 // 已经构造出来的对象个数,包括分配出去的
+   struct list free_list; // 已构造好的空闲对象
+};
+
+void kmem_cache_init(struct kmem_cache* cache, const char* name, uint32_t obj_size,
+		     uint32_t elem_offset, kmem_ctor* ctor, uint32_t free_max);
+void* kmem_cache_alloc(struct kmem_cache* cache);
+void kmem_cache_free(struct kmem_cache* cache, void* obj);
+#endif
@@ -0,0 +1,446 @@
+#include "vma.h"
+#include "stdint.h"
+#include "global.h"
+#include "debug.h"
+#include "memory.h"
+#include "string.h"
+#include "slab.h"
+
+/* vma结点的缓存,vma是内核的数据结构,不论当前是谁都从内核的页中切 */
+static struct kmem_cache vma_cache;
+
+/* 初始化vma结点的缓存,在创建第一个进程之前调用 */
+void vma_init(void)
+{
+    kmem_cache_init(&vma_cache, "vma", sizeof(struct vma), 0, NULL, 0);
+}
+
+/* 初始化空的虚拟地址空间 */
+void vma_tree_init(struct vma_tree *tree)
+{
+    tree->root = NULL;
+    tree->vma_cnt = 0;
+}
+
+/* 返回子树node的高度,空树为0 */
+static int32_t vma_height(struct vma *node)
+{
+    return node == NULL ? 0 : node->height;
+}
+
+/* 根据左右子树重新计算node的高度 */
+static void vma_update_height(struct vma *node)
+{
+    int32_t left_height = vma_height(node->left), right_height = vma_height(node->right);
+    node->height = (left_height > right_height ? left_height : right_height) + 1;
+}
+
+/* 以node为根右旋,返回新的根 */
+static struct vma *vma_rotate_right(struct vma *node)
+{
+    struct vma *new_root = node->left;
+    node->left = new_root->right;
+    new_root->right = node;
+    vma_update_height(node);
+    vma_update_height(new_root);
+    return new_root;
+}
+
+/* 以node为根左旋,返回新的根 */
+static struct vma *vma_rotate_left(struct vma *node)
+{
+    struct vma *new_root = node->right;
+    node->right = new_root->left;
+    new_root->left = node;
+    vma_update_height(node);
+    vma_update_height(new_root);
+    return new_root;
+}
+
+/*
+    Description:
+        插入或删除后,让子树node重新满足AVL的平衡条件
+    Return:
+        平衡后子树的根
+    Details:
+        左右子树高度差超过1时旋转:
+            - 较高的子树向外侧偏(LL/RR),旋转一次
+            - 较高的子树向内侧偏(LR/RL),先旋转较高的子树,再旋转node
+*/
+static struct vma *vma_rebalance(struct vma *node)
+{
+    vma_update_height(node);
+    int32_t balance = vma_height(node->left) - vma_height(node->right);
+    if (balance > 1)
+    {
+        if (vma_height(node->left->left) < vma_height(node->left->right))
+        {
+            node->left = vma_rotate_left(node->left);
+        }
+        return vma_rotate_right(node);
+    }
+    if (balance < -1)
+    {
+        if (vma_height(node->right->right) < vma_height(node->right->left))
+        {
+            node->right = vma_rotate_right(node->right);
+        }
+        return vma_rotate_left(node);
+    }
+    return node;
+}
+
+/* 把new_vma插入子树node,返回新的根 */
+static struct vma *vma_avl_insert(struct vma *node, struct vma *new_vma)
+{
+    if (node == NULL)
+    {
+        return new_vma;
+    }
+    if (new_vma->start < node->start)
+    {
+        node->left = vma_avl_insert(node->left, new_vma);
+    }
+    else
+    {
+        node->right = vma_avl_insert(node->right, new_vma);
+    }
+    return vma_rebalance(node);
+}
+
+/* 从子树node中摘下起始地址最小的结点存入min,返回新的根 */
+static struct vma *vma_avl_remove_min(struct vma *node, struct vma **min)
+{
+    if (node->left == NULL)
+    {
+        *min = node;
+        return node->right;
+    }
+    node->left = vma_avl_remove_min(node->left, min);
+    return vma_rebalance(node);
+}
+
+/* 从子树node中摘下起始地址为start的结点(不释放),返回新的根 */
+static struct vma *vma_avl_remove(struct vma *node, uint32_t start)
+{
+    ASSERT(node != NULL);
+    if (start < node->start)
+    {
+        node->left = vma_avl_remove(node->left, start);
+    }
+    else if (start > node->start)
+    {
+        node->right = vma_avl_remove(node->right, start);
+    }
+    else
+    {
+        // 有两个子树时,用右子树中最小的结点顶替自己
+        if (node->left == NULL || node->right == NULL)
+        {
+            return node->left != NULL ? node->left : node->right;
+        }
+        struct vma *successor;
+        struct vma *right = vma_avl_remove_min(node->right, &successor);
+        successor->left = node->left;
+        successor->right = right;
+        node = successor;
+    }
+    return vma_rebalance(node);
+}
+
+/* 返回子树node中和[start, end)有重叠的任意一个vma,没有时返回NULL */
+static struct vma *vma_find_overlap(struct vma *node, uint32_t start, uint32_t end)
+{
+    while (node != NULL)
+    {
+        if (node->end <= start)
+        {
+            node = node->right;
+        }
+        else if (node->start >= end)
+        {
+            node = node->left;
+        }
+        else
+        {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+/* 返回包含虚拟地址vaddr的vma,vaddr未预留时返回NULL */
+struct vma *vma_find(struct vma_tree *tree, uint32_t vaddr)
+{
+    return vma_find_overlap(tree->root, vaddr, vaddr + 1);
+}
+
+/* 从缓存中申请一个新的vma结点 */
+static struct vma *vma_alloc(uint32_t start, uint32_t end, uint32_t flags)
+{
+    struct vma *node = kmem_cache_alloc(&vma_cache);
+    if (node != NULL)
+    {
+        node->start = start;
+        node->end = end;
+        node->flags = flags;
+        node->left = node->right = NULL;
+        node->height = 1;
+    }
+    return node;
+}
+
+/*
+    Description:
+        在虚拟地址空间中预留[start, end)
+    Parameters:
+        tree: struct vma_tree* 进程的虚拟地址空间
+        start: uint32_t 起始地址,按页对齐
+        end: uint32_t 结束地址,按页对齐
+        flags: uint32_t VM_xxx
+    Return:
+        成功返回0
+        和已有的vma重叠或者内存不足时返回-1
+    Details:
+        和前后首尾相接且flags相同的vma直接合并,不新增结点,VM_SHARED的除外。
+        合并只改变结点的起止地址,相对顺序不变,所以不用调整树的结构
+*/
+int32_t vma_insert(struct vma_tree *tree, uint32_t start, uint32_t end, uint32_t flags)
+{
+    ASSERT(start < end && start % PG_SIZE == 0 && end % PG_SIZE == 0);
+    if (vma_find_overlap(tree->root, start, end) != NULL)
+    {
+        return -1;
+    }
+
+    struct vma *prev = start > 0 ? vma_find(tree, start - 1) : NULL;
+    struct vma *next = vma_find(tree, end);
+    // 每次连接的共享内存段要能单独断开,不参与合并
+    if (prev != NULL && (prev->flags != flags || (flags & VM_SHARED)))
+    {
+        prev = NULL;
+    }
+    if (next != NULL && (next->flags != flags || (flags & VM_SHARED)))
+    {
+        next = NULL;
+    }
+
+    if (prev != NULL && next != NULL)
+    {
+        // 正好填上两个vma之间的空隙,三段合成一段
+        prev->end = next->end;
+        tree->root = vma_avl_remove(tree->root, next->start);
+        kmem_cache_free(&vma_cache, next);
+        tree->vma_cnt--;
+    }
+    else if (prev != NULL)
+    {
+        prev->end = end;
+    }
+    else if (next != NULL)
+    {
+        next->start = start;
+    }
+    else
+    {
+        struct vma *node = vma_alloc(start, end, flags);
+        if (node == NULL)
+        {
+            return -1;
+        }
+        tree->root = vma_avl_insert(tree->root, node);
+        tree->vma_cnt++;
+    }
+    return 0;
+}
+
+/*
+    Description:
+        取消虚拟地址空间中[start, end)的预留
+    Return:
+        成功返回0
+        需要拆分vma但内存不足时返回-1,此时虚拟地址空间没有被修改
+    Details:
+        每次找出一个和[start, end)重叠的vma:
+            - 整个在范围内的,从树中删除
+            - 只有头或尾在范围内的,截掉这一部分
+            - 范围在vma中间的,把vma拆成前后两段,这时不会再有别的vma和范围重叠
+*/
+int32_t vma_remove(struct vma_tree *tree, uint32_t start, uint32_t end)
+{
+    ASSERT(start < end && start % PG_SIZE == 0 && end % PG_SIZE == 0);
+    struct vma *vma;
+    while ((vma = vma_find_overlap(tree->root, start, end)) != NULL)
+    {
+        if (vma->start < start && vma->end > end)
+        {
+            struct vma *tail = vma_alloc(end, vma->end, vma->flags);
+            if (tail == NULL)
+            {
+                return -1;
+            }
+            vma->end = start;
+            tree->root = vma_avl_insert(tree->root, tail);
+            tree->vma_cnt++;
+            return 0;
+        }
+        if (vma->start < start)
+        {
+            vma->end = start;
+        }
+        else if (vma->end > end)
+        {
+            vma->start = end;
+        }
+        else
+        {
+            tree->root = vma_avl_remove(tree->root, vma->start);
+            kmem_cache_free(&vma_cache, vma);
+            tree->vma_cnt--;
+        }
+    }
+    return 0;
+}
+
+/*
+    Description:
+        按地址从低到高遍历子树node,在gap_start之后找第一个长度不小于size的空隙
+    Parameters:
+        gap_start: uint32_t* 当前空隙的起点,遍历时随着经过的vma向后推进
+    Return:
+        找到时返回true,空隙的起点在*gap_start中
+    Details:
+        node不在gap_start之后时,左子树的vma都在gap_start之前,整个跳过,
+        所以只会访问gap_start附近的结点和经过的空隙
+*/
+static bool vma_gap_search(struct vma *node, uint32_t *gap_start, uint32_t high, uint32_t size)
+{
+    if (node == NULL)
+    {
+        return false;
+    }
+    if (node->start > *gap_start)
+    {
+        if (vma_gap_search(node->left, gap_start, high, size))
+        {
+            return true;
+        }
+        uint32_t gap_end = node->start < high ? node->start : high;
+        if (gap_end > *gap_start && gap_end - *gap_start >= size)
+        {
+            return true;
+        }
+    }
+    if (node->end > *gap_start)
+    {
+        *gap_start = node->end;
+    }
+    if (*gap_start >= high)
+    {
+        return false;
+    }
+    return vma_gap_search(node->right, gap_start, high, size);
+}
+
+/*
+    Description:
+        在[low, high)中找地址最低的、长度不小于size的未预留虚拟地址
+    Return:
+        空隙的起始地址
+        return 0 if not found
+*/
+uint32_t vma_find_gap(struct vma_tree *tree, uint32_t low, uint32_t high, uint32_t size)
+{
+    uint32_t gap_start = low;
+    if (vma_gap_search(tree->root, &gap_start, high, size))
+    {
+        return gap_start;
+    }
+    if (high > gap_start && high - gap_start >= size)
+    {
+        return gap_start;
+    }
+    return 0;
+}
+
+/* 按地址从低到高对子树node中的vma调用func,func返回true时停止并返回该vma */
+static struct vma *vma_traversal_node(struct vma *node, vma_function func, int arg)
+{
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    struct vma *found = vma_traversal_node(node->left, func, arg);
+    if (found != NULL)
+    {
+        return found;
+    }
+    if (func(node, arg))
+    {
+        return node;
+    }
+    return vma_traversal_node(node->right, func, arg);
+}
+
+/* 按地址从低到高把tree中的每个vma传给回调函数func,
+ * arg给func用来判断vma是否符合条件.
+ * 本函数的功能是遍历所有vma,逐个判断是否有符合条件的vma。
+ * 找到符合条件的vma返回vma指针,否则返回NULL. func中不能修改tree */
+struct vma *vma_traversal(struct vma_tree *tree, vma_function func, int arg)
+{
+    return vma_traversal_node(tree->root, func, arg);
+}
+
+/* 复制子树src到*dst,结构和src完全一样。失败时已复制的部分仍挂在*dst上,由调用者释放 */
+static int32_t vma_clone(struct vma *src, struct vma **dst)
+{
+    *dst = NULL;
+    if (src == NULL)
+    {
+        return 0;
+    }
+    struct vma *node = kmem_cache_alloc(&vma_cache);
+    if (node == NULL)
+    {
+        return -1;
+    }
+    memcpy(node, src, sizeof(struct vma));
+    node->left = node->right = NULL;
+    *dst = node;
+    if (vma_clone(src->left, &node->left) == -1 || vma_clone(src->right, &node->right) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* 释放子树node中所有的vma */
+static void vma_free_node(struct vma *node)
+{
+    if (node != NULL)
+    {
+        vma_free_node(node->left);
+        vma_free_node(node->right);
+        kmem_cache_free(&vma_cache, node);
+    }
+}
+
+/* 把虚拟地址空间src复制给dst,fork时用。成功返回0,内存不足返回-1 */
+int32_t vma_tree_copy(struct vma_tree *dst, struct vma_tree *src)
+{
+    dst->vma_cnt = src->vma_cnt;
+    if (vma_clone(src->root, &dst->root) == -1)
+    {
+        vma_tree_destroy(dst);
+        return -1;
+    }
+    return 0;
+}
+
+/* 释放虚拟地址空间中所有的vma,进程退出时用 */
+void vma_tree_destroy(struct vma_tree *tree)
+{
+    vma_free_node(tree->root);
+    tree->root = NULL;
+    tree->vma_cnt = 0;
+}
@@ -0,0 +1,42 @@
+#ifndef __KERNEL_VMA_H
+#define __KERNEL_VMA_H
+#include "stdint.h"
+#include "global.h"
+
+#define VM_STACK 0x1 // 用户3级栈
+#define VM_SHARED 0x2 // 连接进来的共享内存段,不和相邻的vma合并
+#define VM_HEAP 0x4 // brk堆,从USER_HEAP_START到program break
+
+/* 共享内存段的vma在flags的高16位记录段号 */
+#define VM_SHM_SHIFT 16
+#define vma_shmid(flags) ((int32_t)((flags) >> VM_SHM_SHIFT))
+
+/* 虚拟内存区域,用户进程中一段已预留的虚拟地址[start, end),首尾按页对齐 */
+struct vma {
+   uint32_t start;
+   uint32_t end;
+   uint32_t flags;	// VM_xxx,首尾相接且flags相同的区域会合并成一个
+   struct vma* left;	// AVL树中起始地址更小的子树
+   struct vma* right;	// AVL树中起始地址更大的子树
+   int32_t height;	// 以此结点为根的子树高度,叶子为1
+};
+
+/* 用户进程的虚拟地址空间,由以起始地址为键的AVL树组织的互不重叠的vma */
+struct vma_tree {
+   struct vma* root;
+   uint32_t vma_cnt;	// 树中vma的个数
+};
+
+/* 自定义函数类型vma_function,用于在vma_traversal中做回调函数 */
+typedef bool(vma_function)(struct vma*, int arg);
+
+void vma_init(void);
+void vma_tree_init(struct vma_tree* tree);
+struct vma* vma_find(struct vma_tree* tree, uint32_t vaddr);
+uint32_t vma_find_gap(struct vma_tree* tree, uint32_t low, uint32_t high, uint32_t size);
+int32_t vma_insert(struct vma_tree* tree, uint32_t start, uint32_t end, uint32_t flags);
+int32_t vma_remove(struct vma_tree* tree, uint32_t start, uint32_t end);
+struct vma* vma_traversal(struct vma_tree* tree, vma_function func, int arg);
+int32_t vma_tree_copy(struct vma_tree* dst, struct vma_tree* src);
+void vma_tree_destroy(struct vma_tree* tree);
+#endif
@@ -9,6 +9,7 @@
 void bitmap_init(struct bitmap *btmp)
 {
     memset(btmp->bits, 0, btmp->btmp_bytes_len);
+    btmp->next_fit = 0;
 }
 
 /* 判断bit_idx位是否为1,若为1则返回true，否则返回false */
@@ -19,61 +20,174 @@ bool bitmap_scan_test(struct bitmap *btmp, uint32_t bit_idx)
     return (btmp->bits[byte_idx] & (BITMAP_MASK << bit_odd));
 }
 
-/* 在位图中申请连续cnt个位,返回其起始位下标 */
-int bitmap_scan(struct bitmap *btmp, uint32_t cnt)
+/* 返回word中最低的为1的位的下标,word不能为0 */
+static uint32_t bit_scan_forward(uint32_t word)
 {
-    uint32_t idx_byte = 0; // 用于记录空闲位所在的字节
-                           /* 先逐字节比较,蛮力法 */
-    while ((0xff == btmp->bits[idx_byte]) && (idx_byte < btmp->btmp_bytes_len))
+    uint32_t idx;
+    asm("bsfl %1, %0"
+        : "=r"(idx)
+        : "rm"(word));
+    return idx;
+}
+
+/*
+    Description:
+        读出位图中第word_idx个32位字
+    Details:
+        位图的字节数不一定是4的倍数,最后一个字只有部分字节属于位图,
+        不属于位图的位当作已占用(1),这样查找空闲位时自然会停在位图末尾
+*/
+static uint32_t bitmap_word(struct bitmap *btmp, uint32_t word_idx)
+{
+    uint32_t byte_idx = word_idx * 4;
+    if (byte_idx + 4 <= btmp->btmp_bytes_len)
+    {
+        return ((uint32_t *)btmp->bits)[word_idx];
+    }
+    uint32_t word = 0xffffffff, byte_odd = 0;
+    while (byte_idx + byte_odd < btmp->btmp_bytes_len)
     {
-        /* 1表示该位已分配,所以若为0xff,则表示该字节内已无空闲位,向下一字节继续找 */
-        idx_byte++;
+        word &= ~(0xffU << (byte_odd * 8));
+        word |= (uint32_t)btmp->bits[byte_idx + byte_odd] << (byte_odd * 8);
+        byte_odd++;
     }
+    return word;
+}
 
-    ASSERT(idx_byte < btmp->btmp_bytes_len);
-    if (idx_byte == btmp->btmp_bytes_len)
-    { // 若该内存池找不到可用空间
-        return -1;
+/* 在[bit_idx, bit_end)中找第一个值为value的位,找不到时返回bit_end */
+static uint32_t bitmap_find(struct bitmap *btmp, uint32_t bit_idx, uint32_t bit_end, int8_t value)
+{
+    while (bit_idx < bit_end)
+    {
+        uint32_t word = bitmap_word(btmp, bit_idx / 32);
+        if (!value)
+        {
+            word = ~word; // 找0就是在取反后的字里找1
+        }
+        word &= 0xffffffff << (bit_idx % 32); // 去掉bit_idx之前的位
+        if (word)
+        {
+            bit_idx = (bit_idx & ~31U) + bit_scan_forward(word);
+            return bit_idx < bit_end ? bit_idx : bit_end;
+        }
+        bit_idx = (bit_idx & ~31U) + 32; // 整个字都不符合,跳到下一个字
     }
+    return bit_end;
+}
 
-    /* 若在位图数组范围内的某字节内找到了空闲位，
-  * 在该字节内逐位比对,返回空闲位的索引。*/
-    int idx_bit = 0;
-    /* 和btmp->bits[idx_byte]这个字节逐位对比 */
-    while ((uint8_t)(BITMAP_MASK << idx_bit) & btmp->bits[idx_byte])
+/* 在[bit_idx, bit_end)中找连续cnt个0,返回起始位下标,找不到返回-1 */
+static int bitmap_find_run(struct bitmap *btmp, uint32_t bit_idx, uint32_t bit_end, uint32_t cnt)
+{
+    while (bit_idx < bit_end)
     {
-        idx_bit++;
+        bit_idx = bitmap_find(btmp, bit_idx, bit_end, 0);
+        if (bit_idx + cnt > bit_end)
+        {
+            return -1;
+        }
+        // 看从bit_idx开始的cnt位里有没有1,没有就找到了,有就从那个1之后接着找
+        uint32_t used_idx = bitmap_find(btmp, bit_idx, bit_idx + cnt, 1);
+        if (used_idx == bit_idx + cnt)
+        {
+            return bit_idx;
+        }
+        bit_idx = used_idx + 1;
     }
+    return -1;
+}
 
-    int bit_idx_start = idx_byte * 8 + idx_bit; // 空闲位在位图内的下标
-    if (cnt == 1)
+/*
+    Description:
+        在位图中申请连续cnt个位,返回其起始位下标
+    Return:
+        起始位下标
+        return -1 if failed
+    Details:
+        - 每次按32位的字比较,用bsf指令直接定位字中第一个空闲位或占用位
+        - 从上次分配结束的位置(next_fit)开始找,找不到再绕回开头找,
+          避免每次都从头跨过前面已经分配出去的大片位
+        - 本函数只查找,不修改位图,调用者随后用bitmap_set_range占用
+*/
+int bitmap_scan(struct bitmap *btmp, uint32_t cnt)
+{
+    uint32_t bit_total = btmp->btmp_bytes_len * 8;
+    uint32_t hint = btmp->next_fit < bit_total ? btmp->next_fit : 0;
+    int bit_idx_start = bitmap_find_run(btmp, hint, bit_total, cnt);
+    if (bit_idx_start == -1 && hint > 0)
     {
-        return bit_idx_start;
+        // 绕回开头,找到hint为止(跨过hint的空闲段也要算上)
+        uint32_t bit_end = hint + cnt - 1 < bit_total ? hint + cnt - 1 : bit_total;
+        bit_idx_start = bitmap_find_run(btmp, 0, bit_end, cnt);
     }
+    if (bit_idx_start != -1)
+    {
+        btmp->next_fit = bit_idx_start + cnt;
+    }
+    return bit_idx_start;
+}
 
-    uint32_t bit_left = (btmp->btmp_bytes_len * 8 - bit_idx_start); // 记录还有多少位可以判断
-    uint32_t next_bit = bit_idx_start + 1;
-    uint32_t count = 1; // 用于记录找到的空闲位的个数
+/* 返回位图btmp中值为1的位数,按32位的字统计,末尾不满一个字的字节逐个统计 */
+uint32_t bitmap_count(struct bitmap *btmp)
+{
+    uint32_t word_cnt = btmp->btmp_bytes_len / 4, word_idx, byte_idx, cnt = 0;
+    for (word_idx = 0; word_idx < word_cnt; word_idx++)
+    {
+        uint32_t word = ((uint32_t *)btmp->bits)[word_idx];
+        word = word - ((word >> 1) & 0x55555555);
+        word = (word & 0x33333333) + ((word >> 2) & 0x33333333);
+        word = (word + (word >> 4)) & 0x0f0f0f0f;
+        cnt += (word * 0x01010101) >> 24;
+    }
+    for (byte_idx = word_cnt * 4; byte_idx < btmp->btmp_bytes_len; byte_idx++)
+    {
+        uint8_t byte = btmp->bits[byte_idx];
+        while (byte)
+        {
+            byte &= byte - 1;
+            cnt++;
+        }
+    }
+    return cnt;
+}
 
-    bit_idx_start = -1; // 先将其置为-1,若找不到连续的位就直接返回
-    while (bit_left-- > 0)
+/*
+    Description:
+        将位图btmp中从bit_idx开始的连续cnt位设置为value
+    Details:
+        按32位的字处理,一个字内的连续位用掩码一次设置;
+        位图末尾不满一个字的部分逐位设置,避免写到位图之外
+*/
+void bitmap_set_range(struct bitmap *btmp, uint32_t bit_idx, uint32_t cnt, int8_t value)
+{
+    ASSERT((value == 0) || (value == 1));
+    ASSERT(bit_idx + cnt <= btmp->btmp_bytes_len * 8);
+    while (cnt > 0)
     {
-        if (!(bitmap_scan_test(btmp, next_bit)))
-        { // 若next_bit为0
-            count++;
+        uint32_t word_idx = bit_idx / 32, bit_odd = bit_idx % 32;
+        uint32_t bits_in_word = 32 - bit_odd < cnt ? 32 - bit_odd : cnt;
+        if ((word_idx + 1) * 4 <= btmp->btmp_bytes_len)
+        {
+            uint32_t mask = (bits_in_word == 32 ? 0xffffffff : ((1U << bits_in_word) - 1)) << bit_odd;
+            if (value)
+            {
+                ((uint32_t *)btmp->bits)[word_idx] |= mask;
+            }
+            else
+            {
+                ((uint32_t *)btmp->bits)[word_idx] &= ~mask;
+            }
         }
         else
         {
-            count = 0;
+            uint32_t idx;
+            for (idx = 0; idx < bits_in_word; idx++)
+            {
+                bitmap_set(btmp, bit_idx + idx, value);
+            }
         }
-        if (count == cnt)
-        { // 若找到连续的cnt个空位
-            bit_idx_start = next_bit - cnt + 1;
-            break;
-        }
-        next_bit++;
+        bit_idx += bits_in_word;
+        cnt -= bits_in_word;
     }
-    return bit_idx_start;
 }
 
 /* 将位图btmp的bit_idx位设置为value */
@@ -7,10 +7,14 @@ struct bitmap
     uint32_t btmp_bytes_len;
     /* 在遍历位图时,整体上以字节为单位,细节上是以位为单位,所以此处位图的指针必须是单字节 */
     uint8_t *bits;
+    /* next-fit游标,bitmap_scan从这一位开始往后找,找到末尾再绕回开头 */
+    uint32_t next_fit;
 };
 
 void bitmap_init(struct bitmap *btmp);
 bool bitmap_scan_test(struct bitmap *btmp, uint32_t bit_idx);
 int bitmap_scan(struct bitmap *btmp, uint32_t cnt);
 void bitmap_set(struct bitmap *btmp, uint32_t bit_idx, int8_t value);
+void bitmap_set_range(struct bitmap *btmp, uint32_t bit_idx, uint32_t cnt, int8_t value);
+uint32_t bitmap_count(struct bitmap *btmp);
 #endif
@@ -0,0 +1,302 @@
+#include "malloc.h"
+#include "syscall.h"
+#include "string.h"
+#include "global.h"
+#include "memory.h"
+#include "process.h"
+#include "assert.h"
+
+#define HEAP_MAGIC 0x4850414d    // 堆状态已初始化的标记
+#define CHUNK_MAGIC 0x4b4e4843   // 分配出去的块的标记,free时据此检查
+#define CHUNK_HDR 8              // 块头的大小,返回给用户的地址按8字节对齐
+#define CHUNK_ALIGN 16           // 大块的大小按16字节取整
+#define BIN_CNT 8                // 小块的规格:16,32,...,2048字节(含块头)
+#define BIN_MAX_SIZE (16 << (BIN_CNT - 1))
+#define HEAP_GROW_MIN (16 * PG_SIZE) // 堆不够时一次至少长这么多,少陷入内核几次
+
+/* 内存块,块头紧挨在返回给用户的地址前面 */
+struct chunk
+{
+   uint32_t size;       // 整个块的字节数,包括块头。不超过BIN_MAX_SIZE的是小块
+   uint32_t magic;      // 分配出去时为CHUNK_MAGIC
+   struct chunk* next;  // 空闲时作为链表的后继,占用的是用户数据区
+};
+
+/*
+   用户态分配器的状态,放在堆的第一页。
+   lib/user的全局变量在内核映像中,是所有进程共用的,所以状态要放在进程私有的内存里:
+   堆的第一页在创建进程时已经预留,第一次访问时才分配,内容为0,magic为0就表示还没初始化。
+   fork出的子进程以写时复制的方式继承父进程的堆,状态也一起继承
+*/
+struct heap_state
+{
+   uint32_t magic;
+   uint32_t top;                 // 从没切出去过的内存的起点,[top, brk)中全是0
+   uint32_t brk;                 // program break
+   struct chunk* bins[BIN_CNT];  // 小块按规格的空闲链表
+   struct chunk* large_free;     // 大块的空闲链表,按地址从低到高排列,相邻的已合并
+};
+
+#define heap ((struct heap_state*)USER_HEAP_START)
+
+/* 第一次用堆时初始化状态,剩下的内存从状态之后开始切 */
+static void heap_init(void)
+{
+   if (heap->magic == HEAP_MAGIC) {
+      return;
+   }
+   heap->top = USER_HEAP_START + DIV_ROUND_UP(sizeof(struct heap_state), CHUNK_ALIGN) * CHUNK_ALIGN;
+   heap->brk = (uint32_t)brk(NULL);
+   heap->magic = HEAP_MAGIC;
+}
+
+/* 确保[top, top + size)在堆内,不够时调用brk扩展堆。返回false表示内存不足 */
+static bool heap_grow(uint32_t size)
+{
+   uint32_t need_end = heap->top + size;
+   if (need_end <= heap->brk) {
+      return true;
+   }
+   if (need_end < heap->top) {
+      return false;  // 回绕
+   }
+   uint32_t new_brk = heap->brk + HEAP_GROW_MIN > need_end ? heap->brk + HEAP_GROW_MIN : need_end;
+   if ((uint32_t)brk((void*)new_brk) != new_brk) {
+      // 多长一些失败了,再试只长需要的部分
+      new_brk = need_end;
+      if ((uint32_t)brk((void*)new_brk) != new_brk) {
+	 return false;
+      }
+   }
+   heap->brk = new_brk;
+   return true;
+}
+
+/* 从堆顶切一个size字节的新块,内容全为0 */
+static struct chunk* chunk_carve(uint32_t size)
+{
+   if (!heap_grow(size)) {
+      return NULL;
+   }
+   struct chunk* c = (struct chunk*)heap->top;
+   heap->top += size;
+   c->size = size;
+   return c;
+}
+
+/* 大小为size的小块所在的规格 */
+static uint32_t bin_index(uint32_t size)
+{
+   uint32_t idx = 0;
+   while ((16U << idx) < size) {
+      idx++;
+   }
+   return idx;
+}
+
+/* 从大块空闲链表中找第一个不小于size的块,多出来的部分还够一个大块时切下来留在链表中 */
+static struct chunk* large_take(uint32_t size)
+{
+   struct chunk** link = &heap->large_free;
+   while (*link != NULL) {
+      struct chunk* c = *link;
+      if (c->size >= size) {
+	 if (c->size - size > BIN_MAX_SIZE) {
+	    struct chunk* rest = (struct chunk*)((uint32_t)c + size);
+	    rest->size = c->size - size;
+	    rest->next = c->next;
+	    *link = rest;
+	    c->size = size;
+	 } else {
+	    *link = c->next;
+	 }
+	 return c;
+      }
+      link = &c->next;
+   }
+   return NULL;
+}
+
+/*
+   把大块c放回空闲链表,和地址相邻的空闲大块合并。
+   合并后最后一块正好挨着堆顶时,把它还给堆顶:
+   整页的部分用brk还给内核,剩下不到一页的部分清0,保持[top, brk)全是0
+*/
+static void large_put(struct chunk* c)
+{
+   struct chunk* prev = NULL;
+   struct chunk* next = heap->large_free;
+   while (next != NULL && next < c) {
+      prev = next;
+      next = next->next;
+   }
+   if (next != NULL && (uint32_t)c + c->size == (uint32_t)next) {
+      c->size += next->size;
+      next = next->next;
+   }
+   c->next = next;
+   if (prev != NULL && (uint32_t)prev + prev->size == (uint32_t)c) {
+      prev->size += c->size;
+      prev->next = next;
+      c = prev;
+   } else if (prev != NULL) {
+      prev->next = c;
+   } else {
+      heap->large_free = c;
+   }
+
+   if (c->next != NULL || (uint32_t)c + c->size != heap->top) {
+      return;
+   }
+   struct chunk** link = &heap->large_free;
+   while (*link != c) {
+      link = &(*link)->next;
+   }
+   *link = NULL;
+
+   uint32_t old_top = heap->top;
+   heap->top = (uint32_t)c;
+   uint32_t page_end = DIV_ROUND_UP(heap->top, PG_SIZE) * PG_SIZE;
+   memset(c, 0, (page_end < old_top ? page_end : old_top) - heap->top);
+   if (page_end < heap->brk && (uint32_t)brk((void*)page_end) == page_end) {
+      heap->brk = page_end;
+   }
+}
+
+/*
+   Description:
+      在堆中分配size字节的内存
+   Parameters:
+      flags: uint32_t MF_NOZERO时不清0
+   Details:
+      - 不超过BIN_MAX_SIZE的按规格分配,先用同规格释放回来的块,没有再从堆顶切
+      - 更大的先在空闲大块中首次适配,没有再从堆顶切
+      - 只有堆顶不够时才调用brk陷入内核,平时分配和释放都不离开3特权级
+      - 从堆顶切的块本来就是0,只有用过的块需要清0
+*/
+void* malloc_flags(uint32_t size, uint32_t flags)
+{
+   if (size == 0 || size >= USER_STACK3_VADDR) {
+      return NULL;
+   }
+   heap_init();
+   uint32_t need = size + CHUNK_HDR;
+   struct chunk* c;
+   bool fresh = false;
+   if (need <= BIN_MAX_SIZE) {
+      uint32_t idx = bin_index(need);
+      c = heap->bins[idx];
+      if (c != NULL) {
+	 heap->bins[idx] = c->next;
+      } else {
+	 c = chunk_carve(16U << idx);
+	 fresh = true;
+      }
+   } else {
+      need = DIV_ROUND_UP(need, CHUNK_ALIGN) * CHUNK_ALIGN;
+      c = large_take(need);
+      if (c == NULL) {
+	 c = chunk_carve(need);
+	 fresh = true;
+      }
+   }
+   if (c == NULL) {
+      return NULL;
+   }
+   c->magic = CHUNK_MAGIC;
+   void* ptr = (void*)((uint32_t)c + CHUNK_HDR);
+   if (!fresh && !(flags & MF_NOZERO)) {
+      memset(ptr, 0, c->size - CHUNK_HDR);
+   }
+   return ptr;
+}
+
+/* 在堆中分配size字节的内存,已清0 */
+void* malloc(uint32_t size)
+{
+   return malloc_flags(size, 0);
+}
+
+/* 分配nmemb个size字节的元素,已清0。总大小溢出时返回NULL */
+void* calloc(uint32_t nmemb, uint32_t size)
+{
+   if (size != 0 && nmemb > 0xffffffff / size) {
+      return NULL;
+   }
+   return malloc_flags(nmemb * size, 0);
+}
+
+/* 释放malloc分配的内存,小块放回所在规格的链表,大块放回空闲大块链表 */
+void free(void* ptr)
+{
+   if (ptr == NULL) {
+      return;
+   }
+   struct chunk* c = (struct chunk*)((uint32_t)ptr - CHUNK_HDR);
+   assert(c->magic == CHUNK_MAGIC);
+   c->magic = 0;
+   if (c->size <= BIN_MAX_SIZE) {
+      uint32_t idx = bin_index(c->size);
+      c->next = heap->bins[idx];
+      heap->bins[idx] = c;
+   } else {
+      large_put(c);
+   }
+}
+
+/*
+   Description:
+      把ptr处的内存调整为size字节
+   Return:
+      调整后的地址,可能就是ptr;内存不足时返回NULL,原来的内存不变
+   Details:
+      - 块本身放得下时原地返回,大块缩小时把多出来的尾部释放掉
+      - 大块正好在堆顶时,直接把堆顶往后推,原地扩展
+      - 否则分配新块(不清0),复制原来的内容后释放旧块
+*/
+void* realloc(void* ptr, uint32_t size)
+{
+   if (ptr == NULL) {
+      return malloc_flags(size, MF_NOZERO);
+   }
+   if (size == 0) {
+      free(ptr);
+      return NULL;
+   }
+   if (size >= USER_STACK3_VADDR) {
+      return NULL;
+   }
+   struct chunk* c = (struct chunk*)((uint32_t)ptr - CHUNK_HDR);
+   assert(c->magic == CHUNK_MAGIC);
+   uint32_t need = DIV_ROUND_UP(size + CHUNK_HDR, CHUNK_ALIGN) * CHUNK_ALIGN;
+   if (c->size > BIN_MAX_SIZE) {
+      if (need <= BIN_MAX_SIZE) {
+	 need = BIN_MAX_SIZE + CHUNK_ALIGN;  // 留在原地的部分仍要是大块
+      }
+      if (need <= c->size) {
+	 if (c->size - need > BIN_MAX_SIZE) {
+	    struct chunk* rest = (struct chunk*)((uint32_t)c + need);
+	    rest->size = c->size - need;
+	    c->size = need;
+	    large_put(rest);
+	 }
+	 return ptr;
+      }
+      if ((uint32_t)c + c->size == heap->top && heap_grow(need - c->size)) {
+	 heap->top += need - c->size;
+	 c->size = need;
+	 return ptr;
+      }
+   } else if (size + CHUNK_HDR <= c->size) {
+      return ptr;
+   }
+
+   void* new_ptr = malloc_flags(size, MF_NOZERO);
+   if (new_ptr == NULL) {
+      return NULL;
+   }
+   uint32_t old_size = c->size - CHUNK_HDR;
+   memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+   free(ptr);
+   return new_ptr;
+}
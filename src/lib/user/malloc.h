@@ -0,0 +1,10 @@
+#ifndef __LIB_USER_MALLOC_H
+#define __LIB_USER_MALLOC_H
+#include "stdint.h"
+
+void* malloc(uint32_t size);
+void* malloc_flags(uint32_t size, uint32_t flags);
+void* calloc(uint32_t nmemb, uint32_t size);
+void* realloc(void* ptr, uint32_t size);
+void free(void* ptr);
+#endif
@@ -61,16 +61,21 @@ uint32_t write(int32_t fd, const void *buf, uint32_t count)
    return _syscall3(SYS_WRITE, fd, buf, count);
 }
 
-/* 申请size字节大小的内存,并返回结果 */
-void *malloc(uint32_t size)
+/* 把堆的末尾(program break)调整到addr,返回调整后的program break,失败时不变。
+ * addr为NULL时只返回当前的program break */
+void *brk(void *addr)
 {
-   return (void *)_syscall1(SYS_MALLOC, size);
+   return (void *)_syscall1(SYS_BRK, addr);
 }
 
-/* 释放ptr指向的内存 */
-void free(void *ptr)
+/* 把堆扩大increment字节(可以为负),返回原来的program break,失败返回(void*)-1 */
+void *sbrk(int32_t increment)
 {
-   _syscall1(SYS_FREE, ptr);
+   uint32_t old_brk = (uint32_t)brk(NULL);
+   if (increment != 0 && (uint32_t)brk((void *)(old_brk + increment)) != old_brk + increment) {
+      return (void *)-1;
+   }
+   return (void *)old_brk;
 }
 
 /* 派生子进程,返回子进程pid */
@@ -101,6 +106,30 @@ pid_t wait(int32_t *status)
 {
    return _syscall1(SYS_WAIT, status);
 }
+
+/* 和wait一样,但最多等ms毫秒,超时返回0 */
+pid_t wait_timeout(int32_t *status, uint32_t ms)
+{
+   return _syscall2(SYS_WAIT_TIMEOUT, status, ms);
+}
+
+/* 睡眠seconds秒,期间不占用cpu */
+uint32_t sleep(uint32_t seconds)
+{
+   return _syscall1(SYS_SLEEP, seconds);
+}
+
+/* 睡眠usec微秒,精度是一个时钟嘀嗒(10毫秒) */
+int32_t usleep(uint32_t usec)
+{
+   return _syscall1(SYS_USLEEP, usec);
+}
+
+/* 读clock_id对应的时钟,精度是纳秒级的,成功返回0 */
+int32_t clock_gettime(uint32_t clock_id, struct timespec *tp)
+{
+   return _syscall2(SYS_CLOCK_GETTIME, clock_id, tp);
+}
 /* 显示任务列表 */
 void ps(void)
 {
@@ -123,4 +152,35 @@ void help(void)
 int execv(const char *name, void *func, char **argv)
 {
    return _syscall3(SYS_EXECV, name, func, argv);
-}
\ No newline at end of file
+}
+
+/* 获取内存使用情况的快照 */
+void meminfo(struct meminfo *info)
+{
+   _syscall1(SYS_MEMINFO, info);
+}
+
+/* 按键key取得size字节的共享内存段,返回段号,失败返回-1 */
+int32_t shmget(int32_t key, uint32_t size)
+{
+   return _syscall2(SYS_SHMGET, key, size);
+}
+
+/* 把共享内存段shmid连接到自己的地址空间,返回起始地址,失败返回NULL */
+void* shmat(int32_t shmid)
+{
+   return (void*)_syscall1(SYS_SHMAT, shmid);
+}
+
+/* 断开shmat在addr处连接的共享内存段,成功返回0,失败返回-1 */
+int32_t shmdt(void* addr)
+{
+   return _syscall1(SYS_SHMDT, addr);
+}
+
+/* 把进程pid(为0时是自己)放进EDF调度类,每period个嘀嗒最多运行budget个嘀嗒;period为0时回到普通调度类。
+ * 成功返回0,带宽不够或参数不对返回-1 */
+int32_t sched_setdl(pid_t pid, uint32_t period, uint32_t budget)
+{
+   return _syscall3(SYS_SCHED_SETDL, pid, period, budget);
+}
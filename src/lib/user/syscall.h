@@ -3,13 +3,12 @@
 
 #include "stdint.h"
 #include "thread.h"
+#include "timer.h"
 
 enum SYSCALL_NR
 {
     SYS_GETPID,
     SYS_WRITE,
-    SYS_MALLOC,
-    SYS_FREE,
     SYS_FORK,
     SYS_READ,
     SYS_PUTCHAR,
@@ -18,16 +17,25 @@ enum SYSCALL_NR
     SYS_WAIT,
     SYS_CLEAR, // 对应cls_screen函数
     SYS_HELP, // shell的help命令
-    SYS_EXECV
+    SYS_EXECV,
+    SYS_MEMINFO,
+    SYS_SHMGET,
+    SYS_SHMAT,
+    SYS_SHMDT,
+    SYS_BRK,
+    SYS_SCHED_SETDL,
+    SYS_SLEEP,
+    SYS_USLEEP,
+    SYS_WAIT_TIMEOUT,
+    SYS_CLOCK_GETTIME
 };
 
 uint32_t getpid(void);
 
 uint32_t write(int32_t fd, const void* buf, uint32_t count);
 
-void *malloc(uint32_t size);
-
-void free(void *ptr);
+void *brk(void *addr);
+void *sbrk(int32_t increment);
 
 int16_t fork(void);
 
@@ -40,9 +48,22 @@ int execv(const char* name, void* func, char** argv);
 
 void exit(int32_t status);
 pid_t wait(int32_t *status);
+pid_t wait_timeout(int32_t *status, uint32_t ms);
+
+uint32_t sleep(uint32_t seconds);
+int32_t usleep(uint32_t usec);
+int32_t clock_gettime(uint32_t clock_id, struct timespec *tp);
 
 void clear(void);
 
+void meminfo(struct meminfo *info);
+
+int32_t shmget(int32_t key, uint32_t size);
+void* shmat(int32_t shmid);
+int32_t shmdt(void* addr);
+
+int32_t sched_setdl(pid_t pid, uint32_t period, uint32_t budget);
+
 // 以下系统调用是给shell专用的
 void help(void);
 #endif
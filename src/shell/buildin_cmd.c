@@ -1,5 +1,6 @@
 #include "buildin_cmd.h"
 #include "syscall.h"
+#include "malloc.h"
 #include "stdio.h"
 #include "string.h"
 #include "fs.h"
@@ -34,3 +35,72 @@ void buildin_help(void)
 {
     help();
 }
+
+/* 打印一个物理内存区的统计信息,没有内存的区不打印 */
+static void print_zone_info(const char *name, struct zone_info *info)
+{
+    uint32_t order;
+    if (info->total_pages == 0)
+    {
+        return;
+    }
+    printf("%s zone: 0x%x-0x%x, %d pages, %d free (%d zeroed), watermark %d\n",
+           name, info->phy_addr_start, info->phy_addr_end, info->total_pages, info->free_pages,
+           info->zeroed_pages, info->watermark);
+    printf("    free blocks by order:");
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++)
+    {
+        printf(" %d", info->nr_free[order]);
+    }
+    printf("\n");
+}
+
+/* 打印一个内存使用者的统计信息 */
+static void print_pool_info(const char *name, struct pool_info *info)
+{
+    printf("%s: %d/%d pages used, peak %d, large %d blocks/%d pages\n",
+           name, info->used_pages, info->total_pages, info->peak_pages,
+           info->large_cnt, info->large_pages);
+}
+
+/* 打印内存块描述符表的统计信息,没有arena的规格不打印 */
+static void print_block_desc_info(const char *name, struct block_desc_info *info)
+{
+    uint32_t desc_idx;
+    printf("%s blocks (size:arenas*pages/free):", name);
+    for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++)
+    {
+        if (info[desc_idx].arena_cnt > 0)
+        {
+            printf(" %d:%d*%d/%d", info[desc_idx].block_size, info[desc_idx].arena_cnt,
+                   info[desc_idx].arena_pages, info[desc_idx].free_blocks);
+        }
+    }
+    printf("\n");
+}
+
+/* meminfo命令内建函数 */
+void buildin_meminfo(uint32_t argc)
+{
+    if (argc != 1)
+    {
+        printf("meminfo: no argument support!\n");
+        return;
+    }
+    struct meminfo *info = malloc(sizeof(struct meminfo));
+    if (info == NULL)
+    {
+        printf("meminfo: malloc failed!\n");
+        return;
+    }
+    meminfo(info);
+    print_zone_info("normal", &info->normal);
+    print_zone_info("high", &info->high);
+    print_pool_info("kernel", &info->kernel);
+    print_pool_info("user", &info->user);
+    printf("kernel vaddr: %d pages, %d used\n", info->kvaddr_pages, info->kvaddr_used);
+    printf("process vaddr: %d vmas, %d pages, %d shared\n", info->vma_cnt, info->vaddr_pages, info->shared_pages);
+    printf("process heap: brk 0x%x, %d pages\n", info->brk, info->heap_pages);
+    print_block_desc_info("kernel", info->k_descs);
+    free(info);
+}
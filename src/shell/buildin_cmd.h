@@ -4,4 +4,5 @@
 void buildin_ps(uint32_t argc);
 void buildin_clear(uint32_t argc);
 void buildin_help(void);
+void buildin_meminfo(uint32_t argc);
 #endif
\ No newline at end of file
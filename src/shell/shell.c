@@ -165,6 +165,10 @@ static void cmd_execute(uint32_t argc, char **argv)
     {
         buildin_help();
     }
+    else if (strcmp(argv[0], "meminfo") == 0)
+    {
+        buildin_meminfo(argc);
+    }
     else
     {
         int32_t pid = fork();
@@ -3,6 +3,7 @@
 #include "global.h"
 #include "debug.h"
 #include "interrupt.h"
+#include "timer.h"
 
 /* 初始化信号量 */
 void sema_init(struct semaphore *psema, uint8_t value)
@@ -43,6 +44,29 @@ void sema_down(struct semaphore *psema)
     intr_set_status(old_status);
 }
 
+/* 信号量down操作,最多等timeout个嘀嗒。得到信号量返回true,超时返回false,timeout为0时不等待 */
+bool sema_down_timeout(struct semaphore *psema, uint32_t timeout)
+{
+    enum intr_status old_status = intr_disable();
+    uint32_t deadline = ticks + timeout;
+    while (psema->value == 0)
+    {
+        int32_t left = (int32_t)(deadline - ticks);
+        if (left <= 0)
+        {
+            intr_set_status(old_status);
+            return false;
+        }
+        /* 超时时定时器把当前线程从waiters中摘下,下一轮循环发现到时间了返回 */
+        list_append(&psema->waiters, &running_thread()->general_tag);
+        thread_block_timeout(TASK_BLOCKED, left, true);
+    }
+    psema->value--;
+    ASSERT(psema->value == 0);
+    intr_set_status(old_status);
+    return true;
+}
+
 /* 信号量的up操作 */
 void sema_up(struct semaphore *psema)
 {
@@ -19,6 +19,7 @@ struct lock {
 
 void sema_init(struct semaphore* psema, uint8_t value); 
 void sema_down(struct semaphore* psema);
+bool sema_down_timeout(struct semaphore* psema, uint32_t timeout);
 void sema_up(struct semaphore* psema);
 void lock_init(struct lock* plock);
 void lock_acquire(struct lock* plock);
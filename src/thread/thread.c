@@ -10,6 +10,8 @@
 #include "sync.h"
 #include "stdio.h"
 #include "fs.h"
+#include "slab.h"
+#include "timer.h"
 //#include "console.h"
 
 /* pid的位图,最大支持1024个pid */
@@ -25,14 +27,48 @@ struct pid_pool
 
 struct task_struct *main_thread;     // 主线程PCB
 struct task_struct *idle_thread;     // idle线程
-struct list thread_ready_list;       // 就绪队列
 struct list thread_all_list;         // 所有任务队列
 struct lock pid_lock;                // 分配pid锁
-static struct list_elem *thread_tag; // 用于保存队列中的线程结点
+
+/*
+    O(1)调度:就绪线程按动态优先级放在active数组的各个队列中,位图的最低位就是下一个要运行的队列。
+    时间片用完的线程进expired数组,active空了就交换两个数组,重新给所有线程机会
+*/
+#define MAX_SLEEP_AVG 100      // 睡眠平均值的上限,1秒的嘀嗒数
+#define MAX_BONUS 10           // 动态优先级在静态优先级上下浮动的范围
+#define LEVEL_BASE 24          // priority为0时的静态优先级队列
+#define PRIO_PER_LEVEL 4       // priority每大这么多,静态优先级提高一级
+#define INTERACTIVE_BONUS 2    // 奖励不小于此值的是交互式线程,时间片用完仍留在active中
+#define STARVATION_LIMIT 100   // expired中的线程最多等这么多嘀嗒,超过后交互式线程也要进expired
+
+static struct prio_array prio_arrays[2];
+static struct prio_array *active = &prio_arrays[0];  // 还有时间片的就绪线程
+static struct prio_array *expired = &prio_arrays[1]; // 时间片已用完,等待数组交换的线程
+static uint32_t expired_timestamp;                   // expired中第一个线程进入时的ticks
+static bool need_resched;                            // 要尽快调度,在中断返回前检查
+
+/*
+    EDF调度类:声明了周期和预算的线程排在所有普通线程之前,按截止时间从早到晚运行,
+    每个周期最多运行预算个嘀嗒,用完后节流到下一个周期。
+    准入时检查所有EDF线程的带宽(预算/周期)之和不超过DL_BW_MAX,这样每个线程都能在截止时间前做完
+*/
+#define DL_BW_UNIT 1000        // 带宽以千分之一为单位
+#define DL_BW_MAX 900          // 留10%给普通线程,EDF线程再多也不会把它们饿死
+#define DL_PERIOD_MAX 0x100000 // 周期的上限,保证计算带宽时不溢出
+
+static struct list dl_ready_list; // 就绪的EDF线程,按截止时间从早到晚排列
+static struct list dl_threads;    // 所有EDF线程
+static uint32_t dl_bw_total;      // 已分配出去的带宽
+
+/* PCB所在页的缓存,退出的任务的页留给新任务,不用再经过内存池和清0 */
+#define PCB_CACHE_FREE_MAX 16
+static struct kmem_cache pcb_cache;
 
 extern void switch_to(struct task_struct *cur, struct task_struct *next);
 extern void init(void);
 
+static bool thread_ready_exist(void);
+
 /* 系统空闲时运行的线程 */
 static void idle(void *arg)
 {
@@ -40,6 +76,17 @@ static void idle(void *arg)
     while (1)
     {
         thread_block(TASK_BLOCKED);
+        // 没有别的线程可运行,趁空闲预先把页框清0,分配内存时就不用再清了
+        while (!thread_ready_exist() && page_prezero())
+            ;
+        intr_disable();
+        if (thread_ready_exist())
+        { // 清0的过程中有线程就绪了(比如被中断唤醒),马上让出cpu
+            intr_enable();
+            continue;
+        }
+        // 停掉周期时钟,一直睡到下一个要处理的时刻或者被别的中断唤醒
+        timer_tick_stop(thread_nohz_ticks(idle_thread));
         //执行hlt时必须要保证目前处在开中断的情况下
         asm volatile("sti; hlt"
                      :
@@ -159,6 +206,8 @@ void init_thread(struct task_struct *pthread, char *name, int prio)
     pthread->priority = prio;
     pthread->ticks = prio;
     pthread->elapsed_ticks = 0;
+    pthread->sleep_avg = MAX_SLEEP_AVG / 2; // 新线程不奖励也不惩罚
+    pthread->array = NULL;
     pthread->pgdir = NULL;
     pthread->parent_pid = -1;          // -1表示没有父进程
     pthread->stack_magic = 0x19870916; // 自定义的魔数
@@ -184,16 +233,14 @@ void init_thread(struct task_struct *pthread, char *name, int prio)
 struct task_struct *thread_start(char *name, int prio, thread_func function, void *func_arg)
 {
     // 1. 申请内存，存放PCB
-    struct task_struct *thread = get_kernel_pages(1);
+    struct task_struct *thread = pcb_alloc();
     // 2. 初始化PCB的静态属性，比如pid，priority等
     init_thread(thread, name, prio);
     // 3. 让该线程可以执行指定的函数，建立线程和函数的连接
     thread_create(thread, function, func_arg);
 
-    /* 确保之前不在队列中 */
-    ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
     // 4. 加入就绪队列中，等待被操作系统调度执行
-    list_append(&thread_ready_list, &thread->general_tag);
+    thread_ready_enqueue(thread);
 
     /* 确保之前不在队列中 */
     ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
@@ -203,6 +250,18 @@ struct task_struct *thread_start(char *name, int prio, thread_func function, voi
     return thread;
 }
 
+/* 为新任务申请PCB所在的页,页中内容是旧任务留下的,由init_thread或者fork重新填写 */
+struct task_struct *pcb_alloc(void)
+{
+    return kmem_cache_alloc(&pcb_cache);
+}
+
+/* 回收PCB所在的页 */
+void pcb_free(struct task_struct *pthread)
+{
+    kmem_cache_free(&pcb_cache, pthread);
+}
+
 /* 将kernel中的main函数完善为主线程 */
 static void make_main_thread(void)
 {
@@ -211,35 +270,355 @@ static void make_main_thread(void)
     main_thread = running_thread();
     init_thread(main_thread, "main", 31);
 
-    /* main函数是当前线程,当前线程不在thread_ready_list中,
+    /* main函数是当前线程,当前线程不在就绪队列中,
  * 所以只将其加在thread_all_list中. */
     ASSERT(!elem_find(&thread_all_list, &main_thread->all_list_tag));
     list_append(&thread_all_list, &main_thread->all_list_tag);
 }
 
 
+/* 返回word中最低的为1的位的下标,word不能为0 */
+static uint32_t bit_scan_forward(uint32_t word)
+{
+    uint32_t idx;
+    asm("bsfl %1, %0"
+        : "=r"(idx)
+        : "rm"(word));
+    return idx;
+}
+
+/*
+    Description:
+        根据静态优先级和睡眠平均值计算线程的动态优先级
+    Details:
+        priority越大静态优先级越高;睡眠平均值在0到MAX_SLEEP_AVG之间,
+        映射为-MAX_BONUS/2到MAX_BONUS/2的奖励:常阻塞的交互式线程提前,一直占着cpu的线程退后
+*/
+static int32_t sched_bonus(struct task_struct *pthread)
+{
+    return (int32_t)(pthread->sleep_avg * MAX_BONUS / MAX_SLEEP_AVG) - MAX_BONUS / 2;
+}
+
+static void sched_level_update(struct task_struct *pthread)
+{
+    int32_t level = LEVEL_BASE - pthread->priority / PRIO_PER_LEVEL - sched_bonus(pthread);
+    if (level < 0)
+    {
+        level = 0;
+    }
+    else if (level > PRIO_LEVELS - 1)
+    {
+        level = PRIO_LEVELS - 1;
+    }
+    pthread->sched_level = level;
+}
+
+/* 把pthread放到array中其动态优先级的队列尾 */
+static void prio_array_enqueue(struct prio_array *array, struct task_struct *pthread)
+{
+    ASSERT(pthread->array == NULL);
+    list_append(&array->queue[pthread->sched_level], &pthread->general_tag);
+    array->bitmap |= 1U << pthread->sched_level;
+    array->nr_active++;
+    pthread->array = array;
+}
+
+/* 把pthread从所在的优先级数组中摘下 */
+static void prio_array_dequeue(struct task_struct *pthread)
+{
+    struct prio_array *array = pthread->array;
+    list_remove(&pthread->general_tag);
+    if (list_empty(&array->queue[pthread->sched_level]))
+    {
+        array->bitmap &= ~(1U << pthread->sched_level);
+    }
+    array->nr_active--;
+    pthread->array = NULL;
+}
+
+/* 周期为period、预算为budget的EDF线程占用的带宽,向上取整 */
+static uint32_t dl_bw(uint32_t period, uint32_t budget)
+{
+    return DIV_ROUND_UP(budget * DL_BW_UNIT, period);
+}
+
+/* pthread当前周期的截止时间是否已到,ticks回绕后也成立 */
+static bool dl_expired(struct task_struct *pthread)
+{
+    return (int32_t)(ticks - pthread->dl_deadline) >= 0;
+}
+
+/* 开始新的周期,预算充满。错过了不止一个周期时从现在开始算 */
+static void dl_replenish(struct task_struct *pthread)
+{
+    pthread->dl_deadline += pthread->dl_period;
+    if (dl_expired(pthread))
+    {
+        pthread->dl_deadline = ticks + pthread->dl_period;
+    }
+    pthread->dl_runtime = pthread->dl_budget;
+}
+
+/* 按截止时间把pthread插入EDF就绪队列,截止时间相同的排在后面 */
+static void dl_enqueue(struct task_struct *pthread)
+{
+    ASSERT(!pthread->dl_queued);
+    struct list_elem *elem = dl_ready_list.head.next;
+    while (elem != &dl_ready_list.tail)
+    {
+        struct task_struct *queued = elem2entry(struct task_struct, general_tag, elem);
+        if ((int32_t)(pthread->dl_deadline - queued->dl_deadline) < 0)
+        {
+            break;
+        }
+        elem = elem->next;
+    }
+    list_insert_before(elem, &pthread->general_tag);
+    pthread->dl_queued = true;
+}
+
+static void dl_dequeue(struct task_struct *pthread)
+{
+    list_remove(&pthread->general_tag);
+    pthread->dl_queued = false;
+}
+
+/* EDF就绪队列的队首,即截止时间最早的线程,队列空时返回NULL */
+static struct task_struct *dl_first(void)
+{
+    if (list_empty(&dl_ready_list))
+    {
+        return NULL;
+    }
+    return elem2entry(struct task_struct, general_tag, dl_ready_list.head.next);
+}
+
+/*
+    Description:
+        把新建或被唤醒的线程放进所属调度类的就绪队列,调用者须已把它的状态设为TASK_READY
+    Details:
+        - 普通线程按动态优先级加入active数组
+        - EDF线程阻塞期间过了截止时间的,开始新的周期;本周期预算已用完的节流,不进队列
+*/
+void thread_ready_enqueue(struct task_struct *pthread)
+{
+    enum intr_status old_status = intr_disable();
+    if (timer_tick_restart())
+    { // 有线程要运行了,恢复周期时钟;补记的嘀嗒里要调度的,等中断返回时再调度
+        need_resched = true;
+    }
+    if (pthread->dl_period != 0)
+    {
+        if (dl_expired(pthread))
+        {
+            dl_replenish(pthread);
+        }
+        if (pthread->dl_runtime == 0)
+        {
+            pthread->dl_throttled = true;
+        }
+        else
+        {
+            dl_enqueue(pthread);
+        }
+    }
+    else
+    {
+        sched_level_update(pthread);
+        prio_array_enqueue(active, pthread);
+    }
+    intr_set_status(old_status);
+}
+
+/* 把就绪的pthread从所在的就绪队列中摘下,节流中的EDF线程不在队列中,只清除标记 */
+static void thread_ready_remove(struct task_struct *pthread)
+{
+    if (pthread->array != NULL)
+    {
+        prio_array_dequeue(pthread);
+    }
+    else if (pthread->dl_queued)
+    {
+        dl_dequeue(pthread);
+    }
+    pthread->dl_throttled = false;
+}
+
+/*
+    Description:
+        时钟中断中EDF类的记账
+    Return:
+        需要调度时返回true
+    Details:
+        - 当前线程是EDF线程时消耗预算,用完了要让出
+        - 截止时间到了还就绪或在运行、预算也没用完的EDF线程没能按时做完,记一次错过;
+          到了截止时间的都开始新的周期,被节流的重新进入EDF就绪队列
+        - EDF就绪队列的队首比当前线程优先时抢占:普通线程总是让给EDF线程
+*/
+static bool dl_tick(struct task_struct *cur)
+{
+    bool resched = false;
+    if (cur->dl_period != 0 && cur->dl_runtime > 0 && --cur->dl_runtime == 0)
+    {
+        resched = true;
+    }
+
+    struct list_elem *elem = dl_threads.head.next;
+    while (elem != &dl_threads.tail)
+    {
+        struct task_struct *pthread = elem2entry(struct task_struct, dl_tag, elem);
+        elem = elem->next;
+        if ((pthread->status != TASK_READY && pthread->status != TASK_RUNNING) || !dl_expired(pthread))
+        {
+            continue;
+        }
+        if (!pthread->dl_throttled && pthread->dl_runtime > 0)
+        { // 预算用完的已经把本周期的份额用足了,不算错过
+            pthread->dl_misses++;
+        }
+        dl_replenish(pthread);
+        if (pthread->dl_throttled)
+        {
+            pthread->dl_throttled = false;
+            dl_enqueue(pthread);
+        }
+        else if (pthread->dl_queued)
+        {
+            dl_dequeue(pthread); // 截止时间变了,重新排队
+            dl_enqueue(pthread);
+        }
+    }
+
+    struct task_struct *first = dl_first();
+    if (first != NULL && (cur->dl_period == 0 || (int32_t)(first->dl_deadline - cur->dl_deadline) < 0))
+    {
+        resched = true;
+    }
+    return resched;
+}
+
+/* 除了正在运行的线程,是否还有就绪的线程 */
+static bool thread_ready_exist(void)
+{
+    return active->nr_active + expired->nr_active != 0 || !list_empty(&dl_ready_list);
+}
+
+/*
+    Description:
+        当前线程cur还能运行多少个嘀嗒而不需要时钟中断
+    Details:
+        - 有别的线程就绪时要靠时钟中断抢占或轮转,为0
+        - EDF线程每个嘀嗒都要扣预算,节流中的EDF线程要在截止时间准时回到就绪队列,为0
+        - idle不受限制,普通线程到时间片用完为止
+*/
+uint32_t thread_nohz_ticks(struct task_struct *cur)
+{
+    if (thread_ready_exist() || cur->dl_period != 0)
+    {
+        return 0;
+    }
+    struct list_elem *elem = dl_threads.head.next;
+    while (elem != &dl_threads.tail)
+    {
+        struct task_struct *pthread = elem2entry(struct task_struct, dl_tag, elem);
+        if (pthread->dl_throttled)
+        {
+            return 0;
+        }
+        elem = elem->next;
+    }
+    return cur == idle_thread ? 0xffffffff : cur->ticks;
+}
+
+/*
+    Description:
+        时钟中断中对当前线程的记账
+    Return:
+        active中有动态优先级比cur高的线程时返回true,调用者应立即调度
+    Details:
+        运行的每个嘀嗒都消耗睡眠平均值,一直占着cpu的线程的动态优先级会逐渐降低。
+        idle只在没有别的就绪线程时运行,有线程就绪就应让出。
+        EDF线程只会被截止时间更早的EDF线程抢占
+*/
+bool thread_tick(struct task_struct *cur)
+{
+    bool resched = dl_tick(cur);
+    if (cur == idle_thread)
+    {
+        return resched || thread_ready_exist();
+    }
+    if (cur->dl_period != 0)
+    {
+        return resched;
+    }
+    if (cur->sleep_avg > 0)
+    {
+        cur->sleep_avg--;
+    }
+    return resched || (active->bitmap != 0 && bit_scan_forward(active->bitmap) < cur->sched_level);
+}
+
+/* 时间片用完的线程放回哪个数组:交互式线程留在active,除非expired中的线程已经等了太久 */
+static void expire_thread(struct task_struct *cur)
+{
+    cur->ticks = cur->priority; // 重新将当前线程的ticks再重置为其priority
+    sched_level_update(cur);
+    bool starving = expired->nr_active != 0 && ticks - expired_timestamp >= STARVATION_LIMIT;
+    if (sched_bonus(cur) >= INTERACTIVE_BONUS && !starving)
+    {
+        prio_array_enqueue(active, cur);
+        return;
+    }
+    if (expired->nr_active == 0)
+    {
+        expired_timestamp = ticks;
+    }
+    prio_array_enqueue(expired, cur);
+}
+
 /*
     Description:
         切换线程，重新进行调度，如果没有线程可以调度，就运行idle线程
     Details:
         实现原理：
-            获取当前线程cur，从就绪队列中获取下一个要执行的线程next，然后切换。
+            获取当前线程cur，EDF就绪队列非空时取截止时间最早的线程,
+            否则在active数组的位图中找到最低的非空队列,取队首线程next，然后切换。
+            active空了就和expired交换,选下一个线程的开销和就绪线程的个数无关
         使用场景：
-            - 该函数一般当时间片用完由时钟中断处理函数调用
+            - 该函数一般当时间片用完或被更高优先级的线程抢占时由时钟中断处理函数调用
             - 或者阻塞时，需要放开时间片，调用该函数切换线程
 */
 void schedule()
 {
     ASSERT(intr_get_status() == INTR_OFF);
+    timer_tick_restart(); // 单次模式下经过的嘀嗒先记到cur上
+    need_resched = false;
+
 
     struct task_struct *cur = running_thread();
     if (cur->status == TASK_RUNNING)
-    { 
-        // 若此线程只是cpu时间片到了,将其加入到就绪队列尾
-        ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-        list_append(&thread_ready_list, &cur->general_tag);
-        cur->ticks = cur->priority; // 重新将当前线程的ticks再重置为其priority;
+    {
         cur->status = TASK_READY;
+        if (cur == idle_thread)
+        {
+            // idle不进就绪队列,没有别的线程可运行时直接选它
+            cur->status = TASK_BLOCKED;
+        }
+        else if (cur->dl_period != 0)
+        {
+            // EDF线程按预算运行,时间片只是让它定期回到这里按截止时间重新排队
+            cur->ticks = cur->priority;
+            thread_ready_enqueue(cur);
+        }
+        else if (cur->ticks == 0)
+        {
+            expire_thread(cur);
+        }
+        else
+        {
+            // 被抢占,剩下的时间片留着,排到同优先级队列的末尾
+            prio_array_enqueue(active, cur);
+        }
     }
     else
     {
@@ -247,19 +626,36 @@ void schedule()
       不需要将其加入队列,因为当前线程不在就绪队列中。*/
     }
 
-    /* 如果就绪队列中没有可运行的任务,就唤醒idle */
-    if (list_empty(&thread_ready_list))
+    if (active->nr_active == 0)
     {
-        thread_unblock(idle_thread);
+        struct prio_array *tmp = active;
+        active = expired;
+        expired = tmp;
     }
 
-    ASSERT(!list_empty(&thread_ready_list));
-    thread_tag = NULL; // thread_tag清空
-                       /* 将thread_ready_list队列中的第一个就绪线程弹出,准备将其调度上cpu. */
-    thread_tag = list_pop(&thread_ready_list);
-    struct task_struct *next = elem2entry(struct task_struct, general_tag, thread_tag);
+    /* 如果就绪队列中没有可运行的任务,就运行idle */
+    struct task_struct *next = dl_first();
+    if (next != NULL)
+    {
+        dl_dequeue(next);
+    }
+    else if (active->nr_active == 0)
+    {
+        next = idle_thread;
+    }
+    else
+    {
+        uint32_t level = bit_scan_forward(active->bitmap);
+        next = elem2entry(struct task_struct, general_tag, active->queue[level].head.next);
+        prio_array_dequeue(next);
+    }
     next->status = TASK_RUNNING;
 
+    /* 按高精度时钟累计cur运行的时间 */
+    uint64_t now = clock_ns();
+    cur->runtime_ns += now - cur->exec_start;
+    next->exec_start = now;
+
     /* 击活任务页表等 */
     process_activate(next);
 
@@ -274,25 +670,89 @@ void thread_block(enum task_status stat)
     enum intr_status old_status = intr_disable();
     struct task_struct *cur_thread = running_thread();
     cur_thread->status = stat; // 置其状态为stat
+    cur_thread->sleep_start = ticks;
     schedule();                // 将当前线程换下处理器
                                /* 待当前线程被解除阻塞后才继续运行下面的intr_set_status */
     intr_set_status(old_status);
 }
 
-/* 将线程pthread解除阻塞 */
+/*
+    Description:
+        中断和系统调用返回被中断的上下文之前调用,frame是中断栈
+    Details:
+        唤醒线程的地方可能正在关中断的临界区中(比如sema_up),不能直接调度,只设置need_resched。
+        返回时被中断的上下文是开中断的,说明不在临界区中,可以像时钟中断一样调度
+*/
+void intr_resched_check(struct intr_stack *frame)
+{
+    if (need_resched && (frame->eflags & EFLAGS_IF_1))
+    {
+        schedule();
+    }
+}
+
+/* thread_block_timeout的定时器参数 */
+struct block_timeout
+{
+    struct task_struct *thread;
+    enum task_status stat;
+    bool in_waitq; // 线程的general_tag是否挂在某个等待队列中
+    bool timed_out;
+};
+
+/* 超时的定时器回调:线程还在阻塞时从等待队列中摘下并唤醒。已经被别人唤醒的不再管 */
+static void block_timeout_expire(void *arg)
+{
+    struct block_timeout *bt = arg;
+    if (bt->thread->status != bt->stat)
+    {
+        return;
+    }
+    if (bt->in_waitq)
+    {
+        list_remove(&bt->thread->general_tag);
+    }
+    bt->timed_out = true;
+    thread_unblock(bt->thread);
+}
+
+/*
+    Description:
+        当前线程以stat状态阻塞,最多阻塞timeout个嘀嗒
+    Parameters:
+        in_waitq: bool 当前线程已经把general_tag挂到了某个等待队列中,超时时要先摘下
+    Return:
+        被别人唤醒返回true,超时返回false
+    Details:
+        须在关中断时调用。定时器在自己的栈上,返回前一定已经到期或取消
+*/
+bool thread_block_timeout(enum task_status stat, uint32_t timeout, bool in_waitq)
+{
+    ASSERT(intr_get_status() == INTR_OFF);
+    struct block_timeout bt = {running_thread(), stat, in_waitq, false};
+    struct timer t;
+    timer_setup(&t, block_timeout_expire, &bt);
+    timer_add(&t, ticks + timeout);
+    thread_block(stat);
+    timer_del(&t);
+    return !bt.timed_out;
+}
+
+/* 将线程pthread解除阻塞,阻塞的时间计入睡眠平均值,常阻塞的线程动态优先级较高,能尽快得到调度 */
 void thread_unblock(struct task_struct *pthread)
 {
     enum intr_status old_status = intr_disable();
     ASSERT(((pthread->status == TASK_BLOCKED) || (pthread->status == TASK_WAITING) || (pthread->status == TASK_HANGING)));
     if (pthread->status != TASK_READY)
     {
-        ASSERT(!elem_find(&thread_ready_list, &pthread->general_tag));
-        if (elem_find(&thread_ready_list, &pthread->general_tag))
+        if (pthread->array != NULL || pthread->dl_queued)
         {
             PANIC("thread_unblock: blocked thread in ready_list\n");
         }
-        list_push(&thread_ready_list, &pthread->general_tag); // 放到队列的最前面,使其尽快得到调度
+        uint32_t slept = ticks - pthread->sleep_start;
+        pthread->sleep_avg = slept >= MAX_SLEEP_AVG - pthread->sleep_avg ? MAX_SLEEP_AVG : pthread->sleep_avg + slept;
         pthread->status = TASK_READY;
+        thread_ready_enqueue(pthread);
     }
     intr_set_status(old_status);
 }
@@ -302,13 +762,72 @@ void thread_yield(void)
 {
     struct task_struct *cur = running_thread();
     enum intr_status old_status = intr_disable();
-    ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-    list_append(&thread_ready_list, &cur->general_tag);
     cur->status = TASK_READY;
+    thread_ready_enqueue(cur);
     schedule();
     intr_set_status(old_status);
 }
 
+/*
+    Description:
+        把任务pid放进EDF调度类,或者让它回到普通调度类
+    Parameters:
+        pid: pid_t 为0时是当前任务
+        period: uint32_t 周期的嘀嗒数,为0时回到普通调度类
+        budget: uint32_t 每个周期最多运行的嘀嗒数,不超过period
+    Return:
+        成功返回0;任务不存在、参数不对或者带宽不够时返回-1
+    Details:
+        准入控制:修改后所有EDF线程的带宽之和不能超过DL_BW_MAX。
+        新的周期从现在开始;任务已经就绪的,换到新调度类的就绪队列中
+*/
+int32_t sys_sched_setdl(pid_t pid, uint32_t period, uint32_t budget)
+{
+    if (period != 0 && (budget == 0 || budget > period || period > DL_PERIOD_MAX))
+    {
+        return -1;
+    }
+    enum intr_status old_status = intr_disable();
+    struct task_struct *pthread = pid == 0 ? running_thread() : pid2thread(pid);
+    if (pthread == NULL || pthread == idle_thread || pthread->status == TASK_HANGING || pthread->status == TASK_DIED)
+    {
+        intr_set_status(old_status);
+        return -1;
+    }
+    uint32_t old_bw = pthread->dl_period != 0 ? dl_bw(pthread->dl_period, pthread->dl_budget) : 0;
+    uint32_t new_bw = period != 0 ? dl_bw(period, budget) : 0;
+    if (dl_bw_total - old_bw + new_bw > DL_BW_MAX)
+    {
+        intr_set_status(old_status);
+        return -1;
+    }
+    dl_bw_total = dl_bw_total - old_bw + new_bw;
+
+    bool ready = pthread->status == TASK_READY;
+    if (ready)
+    {
+        thread_ready_remove(pthread);
+    }
+    if (pthread->dl_period == 0 && period != 0)
+    {
+        list_append(&dl_threads, &pthread->dl_tag);
+    }
+    else if (pthread->dl_period != 0 && period == 0)
+    {
+        list_remove(&pthread->dl_tag);
+    }
+    pthread->dl_period = period;
+    pthread->dl_budget = budget;
+    pthread->dl_deadline = ticks + period;
+    pthread->dl_runtime = budget;
+    if (ready)
+    {
+        thread_ready_enqueue(pthread);
+    }
+    intr_set_status(old_status);
+    return 0;
+}
+
 /* 以填充空格的方式输出buf */
 static void pad_print(char *buf, int32_t buf_len, void *ptr, char format)
 {
@@ -370,6 +889,18 @@ static bool elem2thread_info(struct list_elem *pelem, int arg)
         pad_print(out_pad, 16, "DIED", 's');
     }
     pad_print(out_pad, 16, &pthread->elapsed_ticks, 'x');
+    if (pthread->dl_period != 0)
+    {
+        pad_print(out_pad, 16, "EDF", 's');
+    }
+    else
+    {
+        uint32_t level = pthread->sched_level;
+        pad_print(out_pad, 16, &level, 'x');
+    }
+    pad_print(out_pad, 16, &pthread->dl_misses, 'x');
+    uint32_t runtime_us = (uint32_t)div_u64_rem(pthread->runtime_ns, 1000, NULL);
+    pad_print(out_pad, 16, &runtime_us, 'x');
 
     memset(out_pad, 0, 16);
     ASSERT(strlen(pthread->name) < 17);
@@ -382,7 +913,7 @@ static bool elem2thread_info(struct list_elem *pelem, int arg)
 /* 打印任务列表 */
 void sys_ps(void)
 {
-    char *ps_title = "PID            PPID           STAT           TICKS          COMMAND\n";
+    char *ps_title = "PID            PPID           STAT           TICKS          PRIO           MISS           RUNTIME(us)    COMMAND\n";
     sys_write(stdout_no, ps_title, strlen(ps_title));
     list_traversal(&thread_all_list, elem2thread_info, 0);
 }
@@ -395,13 +926,15 @@ void thread_exit(struct task_struct *thread_over, bool need_schedule)
     thread_over->status = TASK_DIED;
 
     /* 如果thread_over不是当前线程,就有可能还在就绪队列中,将其从中删除 */
-    if (elem_find(&thread_ready_list, &thread_over->general_tag))
-    {
-        list_remove(&thread_over->general_tag);
+    thread_ready_remove(thread_over);
+    if (thread_over->dl_period != 0)
+    { // 归还EDF带宽
+        list_remove(&thread_over->dl_tag);
+        dl_bw_total -= dl_bw(thread_over->dl_period, thread_over->dl_budget);
     }
     if (thread_over->pgdir)
     { // 如是进程,回收进程的页表
-        mfree_page(PF_KERNEL, thread_over->pgdir, 1);
+        page_dir_release(thread_over->pgdir);
     }
 
     /* 从all_thread_list中去掉此任务 */
@@ -410,7 +943,7 @@ void thread_exit(struct task_struct *thread_over, bool need_schedule)
     /* 回收pcb所在的页,主线程的pcb不在堆中,跨过 */
     if (thread_over != main_thread)
     {
-        mfree_page(PF_KERNEL, thread_over, 1);
+        pcb_free(thread_over);
     }
 
     /* 归还pid */
@@ -451,9 +984,19 @@ void thread_init(void)
 {
     put_str("thread_init start\n");
 
-    list_init(&thread_ready_list);
+    uint32_t level;
+    for (level = 0; level < PRIO_LEVELS; level++)
+    {
+        list_init(&prio_arrays[0].queue[level]);
+        list_init(&prio_arrays[1].queue[level]);
+    }
+    list_init(&dl_ready_list);
+    list_init(&dl_threads);
     list_init(&thread_all_list);
     pid_pool_init();
+    /* 空闲时general_tag不在任何队列中,用它把PCB串进缓存;
+     * 退出的线程在自己的页上调用schedule时只会写self_kstack和栈顶,不会碰到general_tag */
+    kmem_cache_init(&pcb_cache, "task_struct", PG_SIZE, offset(struct task_struct, general_tag), NULL, PCB_CACHE_FREE_MAX);
     /* 先创建第一个用户进程:init */
     process_execute(init, "init"); // 放在第一个初始化,这是第一个进程,init进程的pid为1
     /* 将当前main函数创建为线程 */
@@ -4,6 +4,7 @@
 #include "list.h"
 #include "bitmap.h"
 #include "memory.h"
+#include "vma.h"
 
 /* 自定义通用函数类型,它将在很多线程函数中做为形参类型 */
 typedef void thread_func(void *);
@@ -91,20 +92,46 @@ struct task_struct
     uint8_t ticks; // 每次在处理器上执行的时间嘀嗒数
 
     uint32_t elapsed_ticks; // 此任务自上cpu运行后至今占用了多少cpu嘀嗒数, 也就是此任务执行了多久
+    uint64_t runtime_ns;    // 此任务在cpu上运行的纳秒数,切换时按高精度时钟累加
+    uint64_t exec_start;    // 此任务最近一次上cpu时的clock_ns
+
+    uint8_t sched_level;       // 动态优先级,即所在就绪队列的下标,越小越先调度
+    struct prio_array *array;  // 所在的优先级数组,不在就绪队列中时为NULL
+    uint32_t sleep_avg;        // 睡眠平均值,阻塞时累加睡眠的嘀嗒数,运行时每个嘀嗒减1
+    uint32_t sleep_start;      // 最近一次阻塞时的ticks
+
+    uint32_t dl_period;        // EDF线程的周期(嘀嗒),为0表示普通线程
+    uint32_t dl_budget;        // EDF线程每个周期最多运行的嘀嗒数
+    uint32_t dl_deadline;      // 当前周期的截止时间,即下一个周期开始时的ticks
+    uint32_t dl_runtime;       // 当前周期剩下的预算
+    uint32_t dl_misses;        // 截止时间到了还没做完(仍然就绪或在运行,预算也没用完)的次数
+    bool dl_queued;            // 是否在EDF就绪队列中
+    bool dl_throttled;         // 预算用完,要等到下一个周期才能再运行
+    struct list_elem dl_tag;   // 在所有EDF线程的队列中的结点
 
     struct list_elem general_tag; // general_tag的作用是用于线程在一般的队列中的结点
 
     struct list_elem all_list_tag; // all_list_tag的作用是用于线程队列thread_all_list中的结点
 
     uint32_t *pgdir;                              // 进程自己页表的虚拟地址
-    struct virtual_addr userprog_vaddr;           // 用户进程的虚拟地址
-    struct mem_block_desc u_block_desc[DESC_CNT]; // 用户进程内存块描述符
+    struct vma_tree vmas;                         // 用户进程的虚拟地址空间
+    uint32_t brk;                                 // 用户进程堆的末尾(program break),堆从USER_HEAP_START开始
     int16_t parent_pid;                           // 父进程pid
     int8_t exit_status;                           // 进程结束时自己调用exit传入的参数
     uint32_t stack_magic;                         // 用这串数字做栈的边界标记,用于检测栈的溢出
 };
 
-extern struct list thread_ready_list;
+/* 就绪队列的个数,一个32位的位图就能表示哪些队列非空 */
+#define PRIO_LEVELS 32
+
+/* 优先级数组,每个动态优先级一个就绪队列 */
+struct prio_array
+{
+    uint32_t nr_active;              // 数组中就绪线程的总数
+    uint32_t bitmap;                 // 第i位为1表示queue[i]非空
+    struct list queue[PRIO_LEVELS]; // 各动态优先级的就绪队列
+};
+
 extern struct list thread_all_list;
 
 void thread_create(struct task_struct *pthread, thread_func function, void *func_arg);
@@ -115,12 +142,20 @@ void schedule(void);
 void thread_init(void);
 void thread_block(enum task_status stat);
 void thread_unblock(struct task_struct *pthread);
+bool thread_block_timeout(enum task_status stat, uint32_t timeout, bool in_waitq);
 void thread_yield(void);
+void thread_ready_enqueue(struct task_struct *pthread);
+bool thread_tick(struct task_struct *cur);
+void intr_resched_check(struct intr_stack *frame);
+uint32_t thread_nohz_ticks(struct task_struct *cur);
+int32_t sys_sched_setdl(pid_t pid, uint32_t period, uint32_t budget);
 
 pid_t fork_pid(void);
 void sys_ps(void);
 
 void thread_exit(struct task_struct *thread_over, bool need_schedule);
+struct task_struct *pcb_alloc(void);
+void pcb_free(struct task_struct *pthread);
 struct task_struct *pid2thread(int32_t pid);
 void release_pid(pid_t pid);
 
@@ -5,44 +5,48 @@
 #include "debug.h"
 #include "thread.h"
 #include "string.h"
+#include "vma.h"
+#include "shm.h"
 
 extern void intr_exit(void);
 
-/* 将父进程的pcb、虚拟地址位图拷贝给子进程 */
+/* 将父进程的pcb、虚拟地址空间拷贝给子进程 */
 /*
     Description:
         - 浅拷贝父进程的PCB所在物理页内容给子进程
             - PCB所在物理页包含了 用户栈 和 内核栈
-        - 深拷贝拷贝父进程的虚拟地址池位图给子进程
+        - 深拷贝拷贝父进程的vma树给子进程
     Parameters:
         child_thread: struct task_struct*。子进程PCB
         parent_thread: struct task_struct*。父进程PCB
     Returns:
-        成功返回0,失败返回-1
+        成功返回0,失败返回-1,此时子进程的pid已经归还
     Details:
         先浅拷贝父进程PCB所在物理页，这样拷贝了PCB和用户栈和内核栈
-        然后拷贝父进程虚拟地址池的内容
+        然后复制父进程的vma,开销只和vma的个数有关,和地址空间的大小无关
 */
-static int32_t copy_pcb_vaddrbitmap_stack0(struct task_struct *child_thread, struct task_struct *parent_thread)
+static int32_t copy_pcb_vmas_stack0(struct task_struct *child_thread, struct task_struct *parent_thread)
 {
     // 1. 拷贝PCB所在的物理页
     memcpy(child_thread, parent_thread, PG_SIZE);
     child_thread->pid = fork_pid();
     child_thread->elapsed_ticks = 0;
+    child_thread->runtime_ns = 0;
     child_thread->status = TASK_READY;
     child_thread->ticks = child_thread->priority; // 为新进程把时间片充满
     child_thread->parent_pid = parent_thread->pid;
     child_thread->general_tag.prev = child_thread->general_tag.next = NULL;
+    child_thread->array = NULL;
+    child_thread->dl_period = 0; // 子进程不继承EDF的带宽,需要时自己申请
+    child_thread->dl_misses = 0;
+    child_thread->dl_queued = child_thread->dl_throttled = false;
     child_thread->all_list_tag.prev = child_thread->all_list_tag.next = NULL;
-    block_desc_init(child_thread->u_block_desc);
-    // 2. 深拷贝父进程的虚拟地址池的位图
-    uint32_t bitmap_pg_cnt = DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PG_SIZE / 8, PG_SIZE);
-    void *vaddr_btmp = get_kernel_pages(bitmap_pg_cnt);
-    if (vaddr_btmp == NULL)
+    // 2. 深拷贝父进程的vma树
+    if (vma_tree_copy(&child_thread->vmas, &parent_thread->vmas) == -1)
+    {
+        release_pid(child_thread->pid);
         return -1;
-
-    memcpy(vaddr_btmp, child_thread->userprog_vaddr.vaddr_bitmap.bits, bitmap_pg_cnt * PG_SIZE);
-    child_thread->userprog_vaddr.vaddr_bitmap.bits = vaddr_btmp;
+    }
 
     ASSERT(strlen(child_thread->name) < 11); // pcb.name的长度是16,为避免下面strcat越界
     // 默认子进程名字是"父进程_fork"，比如 "init_fork"
@@ -50,71 +54,167 @@ static int32_t copy_pcb_vaddrbitmap_stack0(struct task_struct *child_thread, str
     return 0;
 }
 
+/* buf_page中最多暂存的页表项个数,前一半放虚拟地址,后一半放对应的页表项 */
+#define PTE_BATCH_CNT (PG_SIZE / (2 * sizeof(uint32_t)))
+
 /*
     Description:
-        把父进程的虚拟地址池中位图为1的位对应的物理内存，拷贝给子进程
+        把暂存的cnt个页表项直接写进子进程的页表,不切换页表
     Parameters:
-        child_thread: 子进程
-        parent_thread: 父进程
-        buf_page: 缓冲区，临时存放1个物理页的空间
+        vaddrs: uint32_t* 按地址递增暂存的虚拟地址
+        ptes: uint32_t* 与vaddrs一一对应的页表项
+    Return:
+        成功返回true,子进程的页表建不起来时返回false
     Details:
-        1. 先扫描父进程中位图，哪些位被占用了，即可得出哪些内存用过了
-        2. 把父进程中被占用的内存页，复制到缓冲区buf_page中
-        3. 然后从buf_page内容复制到子进程中
-
-        注意：子进程的虚拟地址要和父进程的相同，但是物理地址不能相同
+        虚拟地址连续的一段用pgdir_map_range一次装入,每个页表只映射一次。
+        某一段装不进去时,这一段和后面的页表项都没有到子进程手里,撤销父进程这边对它们的共享
 */
-static void copy_body_stack3(struct task_struct *child_thread, struct task_struct *parent_thread, void *buf_page)
+static bool install_child_ptes(struct task_struct *child_thread, uint32_t *vaddrs, uint32_t *ptes, uint32_t cnt)
 {
-    // 父进程的虚拟地址池位图
-    uint8_t *vaddr_btmp = parent_thread->userprog_vaddr.vaddr_bitmap.bits;
-    // 父进程位图长度（占用字节数）
-    uint32_t btmp_bytes_len = parent_thread->userprog_vaddr.vaddr_bitmap.btmp_bytes_len;
-    // 父进程位图表示的起始虚拟地址
-    uint32_t vaddr_start = parent_thread->userprog_vaddr.vaddr_start;
-
-    uint32_t idx_byte = 0;
-    uint32_t idx_bit = 0;
-    uint32_t prog_vaddr = 0;
-
-    /************* 1. 查找父进程的用户空间中已有数据的页************/
-    while (idx_byte < btmp_bytes_len)
+    uint32_t run_start = 0, idx;
+    for (idx = 1; idx <= cnt; idx++)
     {
-        // 先按照字节查找
-        if (vaddr_btmp[idx_byte])
+        if (idx == cnt || vaddrs[idx] != vaddrs[idx - 1] + PG_SIZE)
         {
-            // 再按照位查找
-            idx_bit = 0;
-            while (idx_bit < 8)
+            if (!pgdir_map_range(child_thread->pgdir, vaddrs[run_start], ptes + run_start, idx - run_start))
             {
-                /***********2. 拷贝父进程的物理页到子进程中*************/
-                /*但是要注意，拷贝后，父进程和子进程的虚拟地址相同，但是物理地址不同*/
-                if ((BITMAP_MASK << idx_bit) & vaddr_btmp[idx_byte])
+                for (; run_start < cnt; run_start++)
                 {
-                    // 此时的prog_vaddr是父进程的虚拟页地址
-                    prog_vaddr = (idx_byte * 8 + idx_bit) * PG_SIZE + vaddr_start;
-
-                    // 把该父进程的虚拟页对应的物理页内容，拷贝到buf_page中
-                    memcpy(buf_page, (void *)prog_vaddr, PG_SIZE);
-
-                    // 把子进程的页表激活，即cr3寄存器安装为子进程的页表
-                    page_dir_activate(child_thread);
+                    cow_share_undo(vaddrs[run_start]);
+                }
+                return false;
+            }
+            run_start = idx;
+        }
+    }
+    return true;
+}
 
-                    // 页表切换之后，prog_vaddr就表示子进程的虚拟地址了，操作的就是子进程的虚拟地址
-                    // 给prog_vaddr这个虚拟地址分配1个物理页
-                    get_a_page_without_opvaddrbitmap(PF_USER, prog_vaddr);
+/* share_body_stack3遍历父进程vma时用的上下文 */
+struct cow_share_ctx
+{
+    struct task_struct *child_thread;
+    uint32_t *vaddrs;   // 暂存待装入子进程页表的虚拟地址
+    uint32_t *ptes;     // 与vaddrs对应的页表项
+    uint32_t batch_cnt; // 已暂存的个数
+    bool failed;        // 装入子进程页表失败
+};
 
-                    // 然后把父进程的数据复制给子进程
-                    memcpy((void *)prog_vaddr, buf_page, PG_SIZE);
+/*
+    Description:
+        vma_traversal的回调函数,让子进程以写时复制的方式共享vma中已有页框的页
+    Parameters:
+        vma: 父进程的vma
+        arg: struct cow_share_ctx* 遍历的上下文
+    Return:
+        返回false让vma_traversal继续遍历,装入子进程页表失败时返回true结束遍历
+    Details:
+        1. 页表不存在时整个4M都没有页框,直接跳到下一个页目录项管辖的地址
+        2. 把父进程中有页框的页的页表项改成只读并打上PG_COW标记,页框引用计数加1
+        3. 把同样的页表项暂存到ctx,攒满一批后直接写进子进程的页表
+        共享内存段的页本来就是共享的,保持可写,不做写时复制
+*/
+static bool share_vma(struct vma *vma, int arg)
+{
+    struct cow_share_ctx *ctx = (struct cow_share_ctx *)arg;
+    bool shared = vma->flags & VM_SHARED;
+    uint32_t prog_vaddr = vma->start;
+    while (prog_vaddr < vma->end)
+    {
+        if (!(*pde_ptr(prog_vaddr) & PG_P_1))
+        {
+            prog_vaddr = (prog_vaddr & 0xffc00000) + 0x400000;
+            continue;
+        }
+        uint32_t *pte = pte_ptr(prog_vaddr);
+        // 预留了但从没访问过的页没有页框,子进程继承了vma,访问时自己分配
+        if (*pte & PG_P_1)
+        {
+            // 可写的页去掉写权限,以后谁先写谁触发缺页再复制
+            if (!shared && (*pte & PG_RW_W))
+            {
+                *pte = (*pte & ~PG_RW_W) | PG_COW;
+            }
+            page_ref_inc(*pte & 0xfffff000);
 
-                    // 恢复父进程页表
-                    page_dir_activate(parent_thread);
+            ctx->vaddrs[ctx->batch_cnt] = prog_vaddr;
+            ctx->ptes[ctx->batch_cnt] = *pte;
+            if (++ctx->batch_cnt == PTE_BATCH_CNT)
+            {
+                ctx->failed = !install_child_ptes(ctx->child_thread, ctx->vaddrs, ctx->ptes, ctx->batch_cnt);
+                ctx->batch_cnt = 0;
+                if (ctx->failed)
+                {
+                    return true;
                 }
-                idx_bit++;
             }
         }
-        idx_byte++;
+        prog_vaddr += PG_SIZE;
     }
+    return false;
+}
+
+/* vma_traversal的回调函数,共享成功后子进程算作vma中共享内存段的一次新连接 */
+static bool attach_child_shm(struct vma *vma, int arg)
+{
+    (void)arg;
+    if (vma->flags & VM_SHARED)
+    {
+        shm_vma_fork(vma);
+    }
+    return false;
+}
+
+/* vma_traversal的回调函数,fork失败时释放已经装进子进程页表的页框 */
+static bool release_child_frames(struct vma *vma, int arg)
+{
+    (void)arg;
+    user_frames_release(vma->start, vma->end);
+    return false;
+}
+
+/*
+    Description:
+        让子进程以写时复制的方式共享父进程的vma中已有页框的物理内存
+    Parameters:
+        child_thread: 子进程
+        parent_thread: 父进程
+        buf_page: 缓冲区，暂存待装入子进程页表的页表项
+    Return:
+        成功返回0,子进程的页表建不起来时返回-1
+    Details:
+        按地址顺序遍历父进程的vma,只看预留过的地址,见share_vma
+
+        失败时恢复原样,子进程的用户空间里什么也不留:
+            - 没装进子进程的页表项由install_child_ptes撤销共享
+            - 已经装进去的,切换到子进程的页目录,像进程退出时一样释放页框和页表。
+              fork在关中断的系统调用中,中途不会被调度走
+
+        fork时不再复制任何页,父子进程谁先写某一页,谁就在缺页异常中得到一份私有的拷贝,
+        见memory.c的page_fault_fixup
+*/
+static int32_t share_body_stack3(struct task_struct *child_thread, struct task_struct *parent_thread, void *buf_page)
+{
+    uint32_t *vaddrs = buf_page;
+    struct cow_share_ctx ctx = {child_thread, vaddrs, vaddrs + PTE_BATCH_CNT, 0, false};
+    vma_traversal(&parent_thread->vmas, share_vma, (int)&ctx);
+    if (!ctx.failed && ctx.batch_cnt > 0)
+    {
+        ctx.failed = !install_child_ptes(child_thread, ctx.vaddrs, ctx.ptes, ctx.batch_cnt);
+    }
+    if (ctx.failed)
+    {
+        page_dir_activate(child_thread);
+        vma_traversal(&child_thread->vmas, release_child_frames, 0);
+        user_page_tables_release();
+    }
+    else
+    {
+        vma_traversal(&parent_thread->vmas, attach_child_shm, 0);
+    }
+    // 父进程的可写页改成了只读(失败时可能又改回了可写),重新加载一次cr3,刷掉TLB中缓存的页表项
+    page_dir_activate(parent_thread);
+    return ctx.failed ? -1 : 0;
 }
 
 /*
@@ -169,16 +269,16 @@ static int32_t build_child_stack(struct task_struct *child_thread)
         child_thread: 子进程
         parent_thred: 父进程
     Return:
-        -1: 失败
+        -1: 失败,已经给子进程的资源都已收回,只剩PCB所在的页由调用者释放
         0: 成功
     Details:
         拷贝父进程资源给子进程分为以下几个步骤：
-            1. 拷贝父进程的pcb所在物理页、虚拟地址池位图
+            1. 拷贝父进程的pcb所在物理页、vma树
                 - pcb所在物理页包括了用户栈、内核栈
-            2. 拷贝父进程用到的物理页资源给子进程（页表以及映射到的物理页）
-                - 扫描父进程的位图，查看父进程用到了哪些空间
-                - 然后把用到的空间拷贝给子进程
-                - 注意，拷贝后，父进程和子进程的虚拟地址要相同，物理地址要不同
+            2. 让子进程共享父进程用到的物理页（为子进程建页表,映射到同样的物理页）
+                - 遍历父进程的vma，查看父进程用到了哪些空间
+                - 父子进程的页表项都改成只读的写时复制页
+                - 真正的复制推迟到某一方写这一页时,在缺页异常中完成
             3. 构建子进程的用户栈/线程栈/intr_stack
                 - 子进程创建时，是进入内核空间，发起的系统调用，特权级是0级
                 - 所以我们构建子进程的线程栈的eip位置内容，设置为intr_exit中断退出
@@ -187,30 +287,37 @@ static int32_t build_child_stack(struct task_struct *child_thread)
 */
 static int32_t copy_process(struct task_struct *child_thread, struct task_struct *parent_thread)
 {
-    // 内核缓冲区,作为父进程用户空间的数据复制到子进程用户空间的中转
+    // 内核缓冲区,暂存要装入子进程页表的页表项
     void *buf_page = get_kernel_pages(1);
     if (buf_page == NULL)
     {
         return -1;
     }
 
-    // 1. 复制父进程的pcb所在的物理页（包括中断栈、线程栈）、虚拟地址位图给子进程
-    if (copy_pcb_vaddrbitmap_stack0(child_thread, parent_thread) == -1)
+    // 1. 复制父进程的pcb所在的物理页（包括中断栈、线程栈）、vma树给子进程
+    if (copy_pcb_vmas_stack0(child_thread, parent_thread) == -1)
     {
+        mfree_page(PF_KERNEL, buf_page, 1);
         return -1;
     }
 
     // 为子进程创建页表,此页表仅包括内核空间
     // create_page_dir创建页表，不仅包含了页表的768-1022项，还有1023项指向页表自身
     child_thread->pgdir = create_page_dir();
-    if (child_thread->pgdir == NULL)
+
+    // 2. 子进程以写时复制的方式共享父进程进程体（用到的物理页）及用户栈
+    if (child_thread->pgdir == NULL || share_body_stack3(child_thread, parent_thread, buf_page) == -1)
     {
+        if (child_thread->pgdir != NULL)
+        {
+            page_dir_release(child_thread->pgdir); // 用户空间的页目录项已在share_body_stack3中清掉
+        }
+        vma_tree_destroy(&child_thread->vmas);
+        release_pid(child_thread->pid);
+        mfree_page(PF_KERNEL, buf_page, 1);
         return -1;
     }
 
-    // 2. 复制父进程进程体（用到的物理页）及用户栈给子进程
-    copy_body_stack3(child_thread, parent_thread, buf_page);
-
     // 3. 构建子进程thread_stack和修改fork返回值
     build_child_stack(child_thread);
 
@@ -233,7 +340,7 @@ static int32_t copy_process(struct task_struct *child_thread, struct task_struct
 pid_t sys_fork(void)
 {
     struct task_struct *parent_thread = running_thread();
-    struct task_struct *child_thread = get_kernel_pages(1); // 为子进程创建pcb(task_struct结构)
+    struct task_struct *child_thread = pcb_alloc(); // 为子进程创建pcb(task_struct结构)
     if (child_thread == NULL)
     {
         return -1;
@@ -242,12 +349,12 @@ pid_t sys_fork(void)
 
     if (copy_process(child_thread, parent_thread) == -1)
     {
+        pcb_free(child_thread);
         return -1;
     }
 
     /* 添加到就绪线程队列和所有线程队列,子进程由调试器安排运行 */
-    ASSERT(!elem_find(&thread_ready_list, &child_thread->general_tag));
-    list_append(&thread_ready_list, &child_thread->general_tag);
+    thread_ready_enqueue(child_thread);
     ASSERT(!elem_find(&thread_all_list, &child_thread->all_list_tag));
     list_append(&thread_all_list, &child_thread->all_list_tag);
 
@@ -8,9 +8,14 @@
 #include "interrupt.h"
 #include "string.h"
 #include "console.h"
+#include "slab.h"
 
 extern void intr_exit(void);
 
+/* 页目录所在页的缓存 */
+#define PGDIR_CACHE_FREE_MAX 16
+static struct kmem_cache pgdir_cache;
+
 /* 构建用户进程初始上下文信息 */
 void start_process(void* filename_) {
    void* function = filename_;
@@ -24,7 +29,8 @@ void start_process(void* filename_) {
    proc_stack->eip = function;	 // 待执行的用户程序地址
    proc_stack->cs = SELECTOR_U_CODE;
    proc_stack->eflags = (EFLAGS_IOPL_0 | EFLAGS_MBS | EFLAGS_IF_1);
-   proc_stack->esp = (void*)((uint32_t)get_a_page(PF_USER, USER_STACK3_VADDR) + PG_SIZE) ;
+   /* 栈的虚拟地址已经在create_user_vmas中预留,页框在压栈时由缺页异常分配 */
+   proc_stack->esp = (void*)USER_STACK3_TOP;
    proc_stack->ss = SELECTOR_U_DATA; 
    asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g" (proc_stack) : "memory");
 }
@@ -60,52 +66,70 @@ void process_activate(struct task_struct* p_thread) {
    }
 }
 
+/* 页目录的构造函数,用户空间的768项清0,最后一项指向页目录自己。
+ * 进程退出时用户空间的页目录项都会被清掉,所以回收的页目录仍是构造好的状态 */
+static void page_dir_ctor(void* obj) {
+   uint32_t* page_dir_vaddr = obj;
+   memset(page_dir_vaddr, 0, 0x300*4);
+   /* 页目录地址是存入在页目录的最后一项,更新页目录地址为新页目录的物理地址 */
+   page_dir_vaddr[1023] = addr_v2p((uint32_t)page_dir_vaddr) | PG_US_U | PG_RW_W | PG_P_1;
+}
+
 /* 创建页目录表,将当前页表的表示内核空间的pde复制,
- * 成功则返回页目录的虚拟地址,否则返回-1 */
+ * 成功则返回页目录的虚拟地址,否则返回NULL */
 uint32_t* create_page_dir(void) {
 
-   /* 用户进程的页表不能让用户直接访问到,所以在内核空间来申请 */
-   uint32_t* page_dir_vaddr = get_kernel_pages(1);
+   /* 用户进程的页表不能让用户直接访问到,所以在内核空间来申请.
+    * 从缓存中取出的页目录用户部分已清0,自映射项已填好 */
+   uint32_t* page_dir_vaddr = kmem_cache_alloc(&pgdir_cache);
    if (page_dir_vaddr == NULL) {
       console_put_str("create_page_dir: get_kernel_page failed!");
       return NULL;
    }
 
-/************************** 1  先复制页表  *************************************/
-   /*  page_dir_vaddr + 0x300*4 是内核页目录的第768项 */
-   memcpy((uint32_t*)((uint32_t)page_dir_vaddr + 0x300*4), (uint32_t*)(0xfffff000+0x300*4), 1024);
-/*****************************************************************************/
-
-/************************** 2  更新页目录地址 **********************************/
-   uint32_t new_page_dir_phy_addr = addr_v2p((uint32_t)page_dir_vaddr);
-   /* 页目录地址是存入在页目录的最后一项,更新页目录地址为新页目录的物理地址 */
-   page_dir_vaddr[1023] = new_page_dir_phy_addr | PG_US_U | PG_RW_W | PG_P_1;
+/************************** 复制内核部分的页表  *************************************/
+   /* 内核的页目录项可能在页目录进缓存之后又有增加,每次都重新复制这1K,
+    * page_dir_vaddr + 0x300*4 是内核页目录的第768项 */
+   memcpy((uint32_t*)((uint32_t)page_dir_vaddr + 0x300*4), (uint32_t*)(0xfffff000+0x300*4), 1020);
 /*****************************************************************************/
    return page_dir_vaddr;
 }
 
-/* 创建用户进程虚拟地址位图 */
-void create_user_vaddr_bitmap(struct task_struct* user_prog) {
-   user_prog->userprog_vaddr.vaddr_start = USER_VADDR_START;
-   uint32_t bitmap_pg_cnt = DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PG_SIZE / 8 , PG_SIZE);
-   user_prog->userprog_vaddr.vaddr_bitmap.bits = get_kernel_pages(bitmap_pg_cnt);
-   user_prog->userprog_vaddr.vaddr_bitmap.btmp_bytes_len = (0xc0000000 - USER_VADDR_START) / PG_SIZE / 8;
-   bitmap_init(&user_prog->userprog_vaddr.vaddr_bitmap);
+/* 回收进程的页目录,用户空间的页目录项须已在进程退出时清0 */
+void page_dir_release(uint32_t* page_dir_vaddr) {
+   ASSERT(page_dir_vaddr[0] == 0 && page_dir_vaddr[0x2ff] == 0);
+   kmem_cache_free(&pgdir_cache, page_dir_vaddr);
+}
+
+/* 初始化进程用到的对象缓存,要在创建第一个进程之前调用 */
+void process_init(void) {
+   /* 空闲页目录的链表结点放在第0、1项,分配出去时这两项清回0 */
+   kmem_cache_init(&pgdir_cache, "page_dir", PG_SIZE, 0, page_dir_ctor, PGDIR_CACHE_FREE_MAX);
+}
+
+/* 创建用户进程的虚拟地址空间,一开始只有预留的用户3级栈和堆的第一页。
+ * lib/user的全局变量在内核映像中,是所有进程共用的,
+ * 所以用户态分配器把自己的状态放在各进程私有的堆的第一页,页框第一次访问时才分配 */
+void create_user_vmas(struct task_struct* user_prog) {
+   vma_tree_init(&user_prog->vmas);
+   if (vma_insert(&user_prog->vmas, USER_STACK3_VADDR, USER_STACK3_TOP, VM_STACK) == -1 ||
+       vma_insert(&user_prog->vmas, USER_HEAP_START, USER_HEAP_START + PG_SIZE, VM_HEAP) == -1) {
+      PANIC("create_user_vmas: out of memory");
+   }
+   user_prog->brk = USER_HEAP_START + PG_SIZE;
 }
 
 /* 创建用户进程 */
 void process_execute(void* filename, char* name) { 
    /* pcb内核的数据结构,由内核来维护进程信息,因此要在内核内存池中申请 */
-   struct task_struct* thread = get_kernel_pages(1);
+   struct task_struct* thread = pcb_alloc();
    init_thread(thread, name, default_prio); 
-   create_user_vaddr_bitmap(thread);
+   create_user_vmas(thread);
    thread_create(thread, start_process, filename);
    thread->pgdir = create_page_dir();
-   block_desc_init(thread->u_block_desc);
    
    enum intr_status old_status = intr_disable();
-   ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
-   list_append(&thread_ready_list, &thread->general_tag);
+   thread_ready_enqueue(thread);
 
    ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
    list_append(&thread_all_list, &thread->all_list_tag);
@@ -3,12 +3,17 @@
 #include "thread.h"
 #include "stdint.h"
 #define default_prio 31
-#define USER_STACK3_VADDR  (0xc0000000 - 0x1000)
+#define USER_STACK3_TOP  0xc0000000	// 用户3级栈栈顶,栈向下增长
+#define USER_STACK3_MAX_SIZE  0x800000	// 用户3级栈最大8M,创建进程时整段预留,用到哪页才分配哪页
+#define USER_STACK3_VADDR  (USER_STACK3_TOP - USER_STACK3_MAX_SIZE)	// 用户3级栈的最低地址
 #define USER_VADDR_START 0x8048000
+#define USER_HEAP_START  0x40000000	// brk堆的起始地址,第一页创建进程时就预留,给用户态分配器存放自己的状态
 void process_execute(void* filename, char* name);
 void start_process(void* filename_);
 void process_activate(struct task_struct* p_thread);
 void page_dir_activate(struct task_struct* p_thread);
 uint32_t* create_page_dir(void);
-void create_user_vaddr_bitmap(struct task_struct* user_prog);
+void create_user_vmas(struct task_struct* user_prog);
+void page_dir_release(uint32_t* page_dir_vaddr);
+void process_init(void);
 #endif
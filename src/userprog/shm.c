@@ -0,0 +1,229 @@
+#include "shm.h"
+#include "global.h"
+#include "debug.h"
+#include "memory.h"
+#include "print.h"
+#include "process.h"
+#include "string.h"
+#include "sync.h"
+#include "thread.h"
+#include "vma.h"
+
+/* 共享内存段 */
+struct shm_segment
+{
+    int32_t key;         // 用户约定的键,相同键的shmget拿到同一个段
+    uint32_t pg_cnt;     // 段的页数,为0表示本槽位空闲
+    uint32_t attach_cnt; // 连接了本段的vma个数
+    uint32_t *frames;    // 各页的页框物理地址,第一次连接时才分配,0表示还没分配
+};
+
+static struct shm_segment shm_segments[SHM_MAX_SEGMENTS];
+static struct lock shm_lock;
+
+/* 初始化共享内存段表 */
+void shm_init(void)
+{
+    put_str("shm_init start\n");
+    memset(shm_segments, 0, sizeof(shm_segments));
+    lock_init(&shm_lock);
+    put_str("shm_init done\n");
+}
+
+/*
+    Description:
+        去掉共享内存段seg的一次连接,最后一个连接断开时释放整个段
+    Details:
+        段自己对每个页框持有一个引用,每个连接的页表项再各持有一个引用。
+        调用者须持有shm_lock,并且已经去掉了本次连接的页表项
+*/
+static void shm_put(struct shm_segment *seg)
+{
+    ASSERT(seg->attach_cnt > 0);
+    if (--seg->attach_cnt > 0)
+    {
+        return;
+    }
+    uint32_t idx;
+    for (idx = 0; idx < seg->pg_cnt; idx++)
+    {
+        if (seg->frames[idx] != 0)
+        {
+            pfree(seg->frames[idx]);
+        }
+    }
+    kfree(seg->frames);
+    seg->frames = NULL;
+    seg->pg_cnt = 0;
+}
+
+/*
+    Description:
+        按键key取得共享内存段,不存在时新建一个size字节的段
+    Return:
+        段号shmid,给shmat用
+        size为0或超过SHM_MAX_PAGES页、已有的段比size小、段表已满或内存不足时返回-1
+    Details:
+        新建时只登记段,页框在第一次shmat时才分配。
+        所有连接都断开后段被释放,之后同一个key得到的是新的段
+*/
+int32_t sys_shmget(int32_t key, uint32_t size)
+{
+    uint32_t pg_cnt = DIV_ROUND_UP(size, PG_SIZE);
+    if (pg_cnt == 0 || pg_cnt > SHM_MAX_PAGES)
+    {
+        return -1;
+    }
+
+    lock_acquire(&shm_lock);
+    int32_t shmid, free_shmid = -1;
+    for (shmid = 0; shmid < SHM_MAX_SEGMENTS; shmid++)
+    {
+        struct shm_segment *seg = &shm_segments[shmid];
+        if (seg->pg_cnt == 0)
+        {
+            if (free_shmid == -1)
+            {
+                free_shmid = shmid;
+            }
+        }
+        else if (seg->key == key)
+        {
+            lock_release(&shm_lock);
+            return pg_cnt <= seg->pg_cnt ? shmid : -1;
+        }
+    }
+
+    if (free_shmid != -1)
+    {
+        struct shm_segment *seg = &shm_segments[free_shmid];
+        seg->frames = kmalloc(pg_cnt * sizeof(uint32_t));
+        if (seg->frames == NULL)
+        {
+            free_shmid = -1;
+        }
+        else
+        {
+            memset(seg->frames, 0, pg_cnt * sizeof(uint32_t));
+            seg->key = key;
+            seg->pg_cnt = pg_cnt;
+            seg->attach_cnt = 0;
+        }
+    }
+    lock_release(&shm_lock);
+    return free_shmid;
+}
+
+/*
+    Description:
+        把共享内存段shmid连接到当前进程的虚拟地址空间
+    Return:
+        段在当前进程中的起始虚拟地址
+        不是用户进程、段不存在或内存不足时返回NULL
+    Details:
+        1. 在vma树中找一段空闲的地址,以VM_SHARED预留,段号记在flags里
+        2. 页框已分配的页,增加引用后直接装进当前页表;
+           还没分配的页在此分配清0的页框,段和页表项各持有一个引用
+        3. 所有页一次映射好,共享内存的页不走缺页异常,也不会写时复制
+*/
+void *sys_shmat(int32_t shmid)
+{
+    struct task_struct *cur = running_thread();
+    if (cur->pgdir == NULL || shmid < 0 || shmid >= SHM_MAX_SEGMENTS)
+    {
+        return NULL;
+    }
+
+    lock_acquire(&shm_lock);
+    struct shm_segment *seg = &shm_segments[shmid];
+    if (seg->pg_cnt == 0)
+    {
+        lock_release(&shm_lock);
+        return NULL;
+    }
+    uint32_t size = seg->pg_cnt * PG_SIZE;
+    uint32_t vaddr = vma_find_gap(&cur->vmas, USER_VADDR_START, USER_STACK3_VADDR, size);
+    if (vaddr == 0 ||
+        vma_insert(&cur->vmas, vaddr, vaddr + size, VM_SHARED | ((uint32_t)shmid << VM_SHM_SHIFT)) == -1)
+    {
+        lock_release(&shm_lock);
+        return NULL;
+    }
+    seg->attach_cnt++;
+
+    uint32_t idx;
+    for (idx = 0; idx < seg->pg_cnt; idx++)
+    {
+        uint32_t pg_vaddr = vaddr + idx * PG_SIZE;
+        if (seg->frames[idx] == 0)
+        {
+            uint32_t pg_phy_addr = user_page_alloc_zeroed(pg_vaddr);
+            if (pg_phy_addr == 0)
+            {
+                // 已映射的页和预留的地址一起退回
+                mfree_page(PF_USER, (void *)vaddr, seg->pg_cnt);
+                shm_put(seg);
+                lock_release(&shm_lock);
+                return NULL;
+            }
+            seg->frames[idx] = pg_phy_addr;
+        }
+        else
+        {
+            page_table_add_pte((void *)pg_vaddr, seg->frames[idx] | PG_US_U | PG_RW_W | PG_P_1);
+        }
+        page_ref_inc(seg->frames[idx]);
+    }
+    lock_release(&shm_lock);
+    return (void *)vaddr;
+}
+
+/*
+    Description:
+        断开当前进程在addr处连接的共享内存段
+    Return:
+        成功返回0,addr不是shmat返回的地址或者内存不足时返回-1
+*/
+int32_t sys_shmdt(void *addr)
+{
+    struct task_struct *cur = running_thread();
+    if (cur->pgdir == NULL)
+    {
+        return -1;
+    }
+    struct vma *vma = vma_find(&cur->vmas, (uint32_t)addr);
+    if (vma == NULL || !(vma->flags & VM_SHARED) || vma->start != (uint32_t)addr)
+    {
+        return -1;
+    }
+
+    lock_acquire(&shm_lock);
+    struct shm_segment *seg = &shm_segments[vma_shmid(vma->flags)];
+    // mfree_page会删掉vma,先把用到的信息取出来
+    if (!mfree_page(PF_USER, addr, (vma->end - vma->start) / PG_SIZE))
+    {
+        lock_release(&shm_lock);
+        return -1;
+    }
+    shm_put(seg);
+    lock_release(&shm_lock);
+    return 0;
+}
+
+/* fork时子进程继承了父进程连接共享内存段的vma,段的连接数加1 */
+void shm_vma_fork(struct vma *vma)
+{
+    ASSERT(vma->flags & VM_SHARED);
+    lock_acquire(&shm_lock);
+    shm_segments[vma_shmid(vma->flags)].attach_cnt++;
+    lock_release(&shm_lock);
+}
+
+/* 进程退出时断开vma连接的共享内存段,vma中页表项持有的引用须已释放 */
+void shm_vma_release(struct vma *vma)
+{
+    ASSERT(vma->flags & VM_SHARED);
+    lock_acquire(&shm_lock);
+    shm_put(&shm_segments[vma_shmid(vma->flags)]);
+    lock_release(&shm_lock);
+}
@@ -0,0 +1,15 @@
+#ifndef __USERPROG_SHM_H
+#define __USERPROG_SHM_H
+#include "stdint.h"
+#include "vma.h"
+
+#define SHM_MAX_SEGMENTS 16	// 系统中最多同时存在的共享内存段
+#define SHM_MAX_PAGES 1024	// 一个共享内存段最大4M
+
+void shm_init(void);
+int32_t sys_shmget(int32_t key, uint32_t size);
+void* sys_shmat(int32_t shmid);
+int32_t sys_shmdt(void* addr);
+void shm_vma_fork(struct vma* vma);
+void shm_vma_release(struct vma* vma);
+#endif
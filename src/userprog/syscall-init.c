@@ -10,6 +10,8 @@
 #include "wait_exit.h"
 #include "fs.h"
 #include "exec.h"
+#include "shm.h"
+#include "timer.h"
 
 #define syscall_nr 32
 typedef void *syscall;
@@ -27,8 +29,6 @@ void syscall_init(void)
    put_str("syscall_init start\n");
    syscall_table[SYS_GETPID] = sys_getpid;
    syscall_table[SYS_WRITE] = sys_write;
-   syscall_table[SYS_MALLOC] = sys_malloc;
-   syscall_table[SYS_FREE] = sys_free;
    syscall_table[SYS_FORK] = sys_fork;
    syscall_table[SYS_READ] = sys_read;
    syscall_table[SYS_PUTCHAR] = sys_putchar;
@@ -38,6 +38,16 @@ void syscall_init(void)
    syscall_table[SYS_WAIT] = sys_wait;
    syscall_table[SYS_HELP] = sys_help;
    syscall_table[SYS_EXECV] = sys_execv;
+   syscall_table[SYS_MEMINFO] = sys_meminfo;
+   syscall_table[SYS_SHMGET] = sys_shmget;
+   syscall_table[SYS_SHMAT] = sys_shmat;
+   syscall_table[SYS_SHMDT] = sys_shmdt;
+   syscall_table[SYS_BRK] = sys_brk;
+   syscall_table[SYS_SCHED_SETDL] = sys_sched_setdl;
+   syscall_table[SYS_SLEEP] = sys_sleep;
+   syscall_table[SYS_USLEEP] = sys_usleep;
+   syscall_table[SYS_WAIT_TIMEOUT] = sys_wait_timeout;
+   syscall_table[SYS_CLOCK_GETTIME] = sys_clock_gettime;
    
    put_str("syscall_init done\n");
 }
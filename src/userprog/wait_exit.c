@@ -5,77 +5,50 @@
 #include "list.h"
 #include "stdio-kernel.h"
 #include "memory.h"
-#include "bitmap.h"
+#include "vma.h"
+#include "shm.h"
+#include "timer.h"
+
+#define WAIT_FOREVER 0xffffffff
+
+/* vma_traversal的回调函数,释放vma中已经映射的页框并断开共享内存段,返回false让遍历继续 */
+static bool release_vma_frames(struct vma *vma, int arg)
+{
+    (void)arg;
+    user_frames_release(vma->start, vma->end);
+    if (vma->flags & VM_SHARED)
+    {
+        shm_vma_release(vma);
+    }
+    return false;
+}
 
 /*
 	Description:
 		回收某个进程的资源
 	Prameters:
-		release_thread: 要被释放的进程
+		release_thread: 要被释放的进程,必须是当前进程,页表要通过当前的页目录访问
 	Details:
 		- 回收该进程动态分配的物理空间
-			- 通过页表映射的物理空间
-		- 回收该PCB的虚拟地址池占用的空间
+			- 只按vma树走进程预留过的地址,没有页表的4M整段跳过,
+			  所以退出的开销和进程实际用到的内存成正比,而不是每次检查768*1024个页表项
+			- 页框按页表成批归还,页表最后一起释放
+		- 回收该进程的vma树
 		- 自身PCB所占用的物理页并没有释放（还包括了用户栈和内核栈）
 */
 static void release_prog_resource(struct task_struct *release_thread)
 {
-    uint32_t *pgdir_vaddr = release_thread->pgdir;
-    uint16_t user_pde_nr = 768, pde_idx = 0;
-    uint32_t pde = 0;
-    uint32_t *v_pde_ptr = NULL; // v表示var,和函数pde_ptr区分
-
-    uint16_t user_pte_nr = 1024, pte_idx = 0;
-    uint32_t pte = 0;
-    uint32_t *v_pte_ptr = NULL; // 加个v表示var,和函数pte_ptr区分
+    ASSERT(release_thread == running_thread());
 
-    uint32_t *first_pte_vaddr_in_pde = NULL; // 用来记录pde中第0个pte的地址
-    uint32_t pg_phy_addr = 0;
+    /***************************1. 回收vma中映射的页框*****************************************/
+    vma_traversal(&release_thread->vmas, release_vma_frames, 0);
 
-    /***************************1. 回收页表中用户空间的页框*****************************************/
-    while (pde_idx < user_pde_nr)
-    {
-        // 指向页目录表项的虚拟地址，通过该虚拟地址可以访问该页目录表项
-        v_pde_ptr = pgdir_vaddr + pde_idx;
-        // 取出该页目录表项的内容，就是页表的地址
-        pde = *v_pde_ptr;
-        // 页目录表项（也就是页表的地址）最低位是P位
-        if (pde & 0x00000001)
-        {
-            // 一个页表表示的内存容量是4M,即0x400000
-            // 返回pde_idx * 0x400000 必经的页表项 的虚拟地址
-            // first_pte_vaddr_in_pde,可以访问到 pde_idx * 0x400000 必经的页表项
-            first_pte_vaddr_in_pde = pte_ptr(pde_idx * 0x400000);
-            pte_idx = 0;
-            while (pte_idx < user_pte_nr)
-            {
-                // 指向页表项的虚拟的地址，通过该虚拟地址可以访问到该页表项
-                v_pte_ptr = first_pte_vaddr_in_pde + pte_idx;
-                // 取出该页表项的内容，也就是物理页的物理地址
-                pte = *v_pte_ptr;
-                // 如果页表项的P位是1,说明连接了物理页
-                // pte页表项的内容是物理页的物理地址
-                if (pte & 0x00000001)
-                {
-                    // 页表项的高20位就是物理页的地址
-                    // 因为一个物理页占4KB，只需要高20位就可以表示了
-                    pg_phy_addr = pte & 0xfffff000;
-                    free_a_phy_page(pg_phy_addr);
-                }
-                pte_idx++;
-            }
-            // 页目录表项的高20位，就是页表的物理地址
-            // 因为一个页表占用一个物理页4KB，只需要20位就可以表示了
-            pg_phy_addr = pde & 0xfffff000;
-            free_a_phy_page(pg_phy_addr);
-        }
-        pde_idx++;
-    }
+    /***************************2. 回收用户空间的页表*****************************************/
+    // brk缩小、shmdt归还过的地址已不在vma中,但页表可能还在,所以页表按页目录统一回收
+    user_page_tables_release();
 
-    /***************************2. 虚拟地址池占用的位图*****************************************/
-    uint32_t bitmap_pg_cnt = (release_thread->userprog_vaddr.vaddr_bitmap.btmp_bytes_len) / PG_SIZE;
-    uint8_t *user_vaddr_pool_bitmap = release_thread->userprog_vaddr.vaddr_bitmap.bits;
-    mfree_page(PF_KERNEL, user_vaddr_pool_bitmap, bitmap_pg_cnt);
+    /***************************3. 虚拟地址空间的vma树*****************************************/
+    vma_tree_destroy(&release_thread->vmas);
 }
 
 /* list_traversal的回调函数,
@@ -117,20 +90,16 @@ static bool init_adopt_a_child(struct list_elem *pelem, int32_t pid)
 
 /*
     Description:
-        等待子进程调用wait，接受子进程返回值，释放子进程PCB
-    Parameters:
-        status: int32_t*。 把子进程的pid保存到status指向的内存空间
+        等待子进程调用exit，最多等timeout个嘀嗒，为WAIT_FOREVER时一直等
     Return:
         child_pid: 子进程的pid
-        -1： 失败
-    Details:
-        - 持续遍历所有线程链表，找到父进程的pid为当前pid，并且处于hanging状态的进程
-        - 获取出该进程的退出状态，保存起来
-        - 给该进程收尸，回收PCB所在的空间
+        0: 超时
+        -1: 没有子进程
 */
-pid_t sys_wait(int32_t *status)
+static pid_t wait_child(int32_t *status, uint32_t timeout)
 {
     struct task_struct *parent_thread = running_thread();
+    uint32_t deadline = ticks + timeout;
 
     while (1)
     {
@@ -158,14 +127,46 @@ pid_t sys_wait(int32_t *status)
         { // 若没有子进程则出错返回
             return -1;
         }
-        else
+
+        /* 若子进程还未运行完,即还未调用exit,则将自己挂起,直到子进程在执行exit时将自己唤醒或者超时 */
+        if (timeout == WAIT_FOREVER)
         {
-            /* 若子进程还未运行完,即还未调用exit,则将自己挂起,直到子进程在执行exit时将自己唤醒 */
             thread_block(TASK_WAITING);
+            continue;
         }
+        int32_t left = (int32_t)(deadline - ticks);
+        if (left <= 0)
+        {
+            return 0;
+        }
+        thread_block_timeout(TASK_WAITING, left, false);
     }
 }
 
+/*
+    Description:
+        等待子进程调用wait，接受子进程返回值，释放子进程PCB
+    Parameters:
+        status: int32_t*。 把子进程的pid保存到status指向的内存空间
+    Return:
+        child_pid: 子进程的pid
+        -1： 失败
+    Details:
+        - 持续遍历所有线程链表，找到父进程的pid为当前pid，并且处于hanging状态的进程
+        - 获取出该进程的退出状态，保存起来
+        - 给该进程收尸，回收PCB所在的空间
+*/
+pid_t sys_wait(int32_t *status)
+{
+    return wait_child(status, WAIT_FOREVER);
+}
+
+/* 和sys_wait一样,但最多等ms毫秒,超时返回0,用于定期检查子进程而不一直阻塞 */
+pid_t sys_wait_timeout(int32_t *status, uint32_t ms)
+{
+    return wait_child(status, ms_to_ticks(ms));
+}
+
 /*
     Description:
         exit系统调用的内核实现, 功能就是回收自己进程所占用的资源（PCB除外）。
@@ -2,5 +2,6 @@
 #define __USERPROG_WAITEXIT_H
 #include "thread.h"
 pid_t sys_wait(int32_t* status);
+pid_t sys_wait_timeout(int32_t* status, uint32_t ms);
 void sys_exit(int32_t status);
 #endif 